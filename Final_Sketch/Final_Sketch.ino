@@ -58,12 +58,46 @@ int dist_to_rear;
 //Same as dist_to_right, but constant once it's initialised. Used to return to start.
 int follow_path;
 
+//Finish turns by the compass instead of the spin scales. U: must be tested before it's turned on
+const bool turn_by_compass = false;
+
+bool compass(float &heading){
+  /*
+   * Heading feedback for the driver's turns (new compass readings only).
+   */
+  return sensors.pollMagBearing(heading);
+}
+
 void forward_scan(){
   
 }
 
 void magnet_scan(){
-  
+  /*
+   * Spins on the spot once while the magnetic sensor collects readings, then goes to collect the strongest target (if any).
+   */
+  MagTarget target;
+  MagSweep sweep;
+  sensors.beginMagSweep(sweep);
+  driver.setTurnFeedback(NULL); //The sweep needs every compass reading
+  driver.resetHeading();
+  driver.turnAngle(360, 0.5); //Slow, so there are plenty of readings
+  driver.run();
+  while(driver.isDriving()){
+    driver.run();
+    sensors.sampleMagSweep(driver.getHeading());
+  }
+  driver.stopAll();
+  if(turn_by_compass){
+    driver.setTurnFeedback(compass);
+  }
+  if(sensors.endMagSweep(target)){
+    Serial.print("Target bearing: ");
+    Serial.print(target.bearing);
+    Serial.print(" range: ");
+    Serial.println(target.range);
+    collect(target.bearing, max(target.range - 50, 0)); //U: 50 must be tested (stop short so the arm can reach)
+  }
 }
 
 void check_return(){
@@ -86,14 +120,20 @@ void check_return(){
    }
 }
 
+//Pre-test motion, kept in flash (see DriveControl's README)
+const byte pre_test_script[] PROGMEM = {
+  DRIVE_FORWARD(50),
+  DRIVE_BACKWARD(20),
+  DRIVE_TURN(20),
+  DRIVE_TURN(-20),
+  DRIVE_END
+};
+
 void pre_test(){
   /*
    * Demonstrates functionality for the pretest.
    */
-  driver.forward(50);
-  driver.backward(20);
-  driver.turnAngle(20);
-  driver.turnAngle(-20);
+  driver.runScript(pre_test_script);
   control(); //execute and clear queue
   int comparison = millis();//Used to end while statement below
   while(millis() - comparison < 10000){
@@ -116,15 +156,26 @@ void pre_test(){
 
 void straighten(){
   /*
-   * Takes sensor input from left and right walls and uses it to align itself parallel with the walls.
+   * Drives forward a little while fitting a line to the right wall, then turns parallel to it.
+   * Falls back to the left wall if the right one couldn't be fitted.
    */
-  int distance = sensors.getRightDistance() + sensors.getLeftDistance() + width;
-  float rad_turn = acos(1200.0/distance);
-  int deg_turn = radians_to_degrees(rad_turn);
-  Serial.println(deg_turn);
-  //Actually turns right :)
-  driver.turnLeft(deg_turn); //Should now be parallel to right and left walls
-  control();
+  sensors.resetWallFit();
+  driver.forward(200);
+  driver.run();
+  while(driver.isDriving()){
+    driver.run();
+    sensors.setTravelled(driver.getDistanceTravelled());
+    sensors.getRightDistance(); //Each reading goes into the wall fit
+    sensors.getLeftDistance();
+  }
+  int side = sensors.isWallFitValid(SONAR_RIGHT) ? SONAR_RIGHT : SONAR_LEFT;
+  if(sensors.isWallFitValid(side)){
+    float deg_turn = sensors.getWallAngle(side);
+    Serial.println(deg_turn);
+    driver.turnAngle(-deg_turn); //Should now be parallel to right and left walls
+    control();
+  }
+  sensors.resetWallFit();
 }
 
 float radians_to_degrees(float radians1){
@@ -141,15 +192,33 @@ void update_sides(){//U: account for all levels and orientations
   dist_to_left = sensors.getLeftDistance();
 }
 
+bool at_start(){
+  return sensors.getFloorType() == FLOOR_START && sensors.getFloorConfidence() > 0.5;
+}
+
 void homeward_bound(){
-   while(sensors.isFloorStart() != true){
-      driver.forward(100);
-      control();
+  /*
+   * Drives straight until the floor is (surely) the start zone, then a bit further to be all the way in.
+   * Goes in short moves (one long move would be too long for a single instruction), giving up after the length of the arena.
+   */
+  int travelled = 0;
+  while(travelled < 3000 && !at_start()){
+    driver.forward(200);
+    driver.run();
+    while(driver.isDriving() && !at_start()){
+      driver.run();
     }
-    driver.forward(100);
-    control();
-    miracle = true;// Made it back!!!
-    //Yipee!!!
+    travelled += 200;
+  }
+  driver.stopAll();
+  if(!at_start()){
+    Serial.println("Start zone not found");
+    return;
+  }
+  driver.forward(100);
+  control();
+  miracle = true;// Made it back!!!
+  //Yipee!!!
 }
 
 void control(){
@@ -199,6 +268,7 @@ void setup() {
   //General setup
   Serial.begin(9600); 
   sensors.setSensorPins(10, 11, 8, 9, 12);
+  //sensors.setFloorAnalog(A0); //U: needs the line tracker's analog output on A0 (instead of the test switch)
   //arm.setServoPins(A0, A1);
   driver.setSpeed(0.9); // Preserve motors
   driver.setMotorPins(3, 4, 2, 5, 6, 7);
@@ -206,6 +276,11 @@ void setup() {
   driver.setTrackWidth(105);
   driver.setRevsPerDC(14);
   driver.setBackScaling(1);
+  driver.loadCalibration(); //Measured constants (tests/drive_calibration) replace the ones above, if there are any
+  //driver.setAcceleration(100); //U: must be tested (less wheel slip, so distances are closer)
+  if(turn_by_compass){
+    driver.setTurnFeedback(compass); //Turns finish by the compass, not the spin scales
+  }
 
   //Reset arm position and initialise LED
   //arm.restPosition();
@@ -274,7 +349,7 @@ void loop() {
       
       else if(sensors.isMagInRange() && sensors.isMagValid()){
         driver.stopAll();
-        //magnet scan
+        magnet_scan();
       }
       
       else if(sensors.getRearDistance() >= 1950 - len && lower_level){
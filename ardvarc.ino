@@ -21,6 +21,7 @@ void setup() {
   driver.setRevsPerDC(11);
   driver.setWheelScales(2, 1);
   driver.setBackScaling(0.1);
+  driver.loadCalibration(); // Measured constants (tests/drive_calibration), if there are any
 }
 
 void loop() {
@@ -1,17 +1,19 @@
 //#include <SensorControl.h>
 //
-//#include <DriveControl.h>
+#include <DriveControl.h>
+
+DriveControl driver;
 
 
 /*
  * xCoordinate = x coordinate of vehicle's position (mm)
  * yCoordinate = y coordinate of vehicle's position (mm) 
- * orientation = direction of front of vehicle relative to starting position, in radians (0 = forward, 90 = right, 180 = back, 270 = left) 
+ * orientation = direction of front of vehicle relative to starting position, in degrees (0 = forward, 90 = right, 180 = back, 270 = left) 
  * !! use mod for left turns and multiple right turns !!
  */
- float x_position = 1003;
- float y_position = 3462;
- float orientation = 37.4;
+ float x_position = 2255;//start in the bottom right corner of the lower level (x_max, y_min below), facing up
+ float y_position = 215;
+ float orientation = 0;
 
 /*
  * len = length from front (or back) to centre of vehicle, to be specified later
@@ -65,92 +67,74 @@ float upper_wall_distance(float y){//returns the distance to the upper boundary
   return upper;
 }
 
-float degrees_to_radians(float degrees1){
-  float radians1 = degrees1 * (pi / 180);
-  return radians1;
-}
-
-float x_rotation(float dist, float overall_angle){
-  //Calculates the new x coordinate of the vehicle's centre after rotation
-  //Parameters : 
-  float change_x;
-  if(overall_angle <= pi){
-    change_x = dist * sin(overall_angle);
-  }
-  else{
-    change_x = -dist * sin(overall_angle);
-  }
-  float new_x = x_position + change_x;
-  return new_x;
-}
-
-float y_rotation(float dist, float overall_angle){
-  //Calculates the new x coordinate of the vehicle's centre after rotation
-  //!!Need to try 'or'
-  float change_y;
-  if(overall_angle <= pi/2){
-    change_y = dist * cos(overall_angle);
+/*
+ * Coverage of the lower level: up and down columns (a lawnmower pattern), from the right wall to the left.
+ * The corners are worked out as they're needed and topped up in loop(), so the driver follows them as one
+ * continuous motion (no stopping to turn at each one).
+ * sweep = gap between columns (mm), about the width the sensors can see
+ */
+ const int sweep = 200;
+ const int x_max = 2400 - width - 100;//keep clear of the walls
+ const int x_min = 1200 + width + 100;
+ const int y_max = 2400 - len - 100;
+ const int y_min = len + 100;
+
+ int leg = 0;//next corner of the pattern
+
+bool next_corner(float &x, float &y){//gives the next corner of the coverage pattern (false once it's covered)
+  // leg 0 is the top of the first column, then across to the next column, down it, across, up...
+  int column = (leg + 1) / 2;
+  x = x_max - column * sweep;
+  if (x < x_min){
+    return false;
   }
-  else if(3*pi/2 < overall_angle <= 2*pi){
-    change_y = dist * cos(overall_angle);
+  if ((leg / 2) % 2 == 0){
+    y = y_max;
   }
   else{
-    change_y = -dist * cos(overall_angle);
+    y = y_min;
   }
-  float new_y = y_position + change_y;
-  return new_y;
+  leg++;
+  return true;
 }
 
-float overall_angle(int front_angle){
-  //Calculates the overall change in angle of the centre of the vehicle, used for x_rotation and y_rotation
-  //Parameters : front_angle -> the angle by which the vehicle has turned, in degrees (-360 <= front_angle <= 360)
-  //!!Try to combine with distance function!!
-  float restricted_front_angle = front_angle % 360; // 0 <= restricted_front_angle < 360
-  float radian_turn = degrees_to_radians(restricted_front_angle);
-  float radian_orientation = degrees_to_radians(orientation);
-  float relative_angle;
-  if(radian_turn <= pi){
-    relative_angle = (3*pi + radian_turn)/2;
-  }
-  else{
-    relative_angle = (-pi + radian_turn)/2;
+void add_corners(){//tops up the driver's waypoints
+  float x, y;
+  while (driver.getWaypointRoom() > 0 && next_corner(x, y)){
+    driver.addWaypoint(x, y);
   }
-  float angle = radian_orientation + relative_angle;
-  return angle;
-}
-
-float distance(int front_angle){
-  float restricted_front_angle = front_angle % 360; // 0 <= restricted_front_angle < 360
-  float radian_turn = degrees_to_radians(restricted_front_angle);
-  float distance = sqrt(2*65*65*(1 - cos(radian_turn)));
-  return distance;
 }
 
 void setup() {
   // put your setup code here, to run once:
   Serial.begin(9600);
-//  driver.setMotorPins(3, 4, 5, 6, 7, 8);
-//  driver.setWheelDiameter(65);
-//  driver.setTrackWidth(125);
-//  driver.setRevsPerDC(31);
+  driver.setMotorPins(3, 4, 5, 6, 7, 8);
+  driver.setWheelDiameter(65);
+  driver.setTrackWidth(125);
+  driver.setRevsPerDC(31);
 //  sensors.setSonarSpacing(20);
   //Set initial positioning by right and rear wall bearings (vehicle should be placed in the right corner)  
   //x_position = 2400 - sensors.getWallDistance() * sin(getWallAngle());
   //y_position = sensors.getDistanceRear() + len;
-  //sqrt(2*65*65*(1 - cos(radian_turn)))
-  float angle = overall_angle(-45);
-  float dist = distance(-45);
-  int y = y_rotation(dist, angle);
-  int x = x_rotation(dist, angle);
-  Serial.print("x is: ");
-  Serial.print(x);
-  Serial.print("  y is: ");
-  Serial.print(y);
-  
-  
+  //DriveControl keeps track of the position (see getPose), so the pattern can be given in arena coordinates
+  driver.setPose(x_position, y_position, orientation);
+  driver.setAcceleration(100);
+  add_corners();
+  driver.followWaypoints();
 }
 
 void loop() {
   // put your main code here, to run repeatedly:
-
+  driver.run();
+  add_corners();
+  if (!driver.isDriving()){
+    int x = driver.getX();
+    int y = driver.getY();
+    Serial.print("Covered. x is: ");
+    Serial.print(x);
+    Serial.print("  y is: ");
+    Serial.println(y);
+    while(true){
+    }
+  }
 }
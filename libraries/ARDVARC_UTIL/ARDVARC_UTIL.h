@@ -19,9 +19,16 @@ License: GPLv3
   #include "WConstants.h"
 #endif
 
+#include <EEPROM.h>
+
 #define TEST_SWITCH_PIN A0
 #define F_DEBUG true // A debug flag that logs Serial messages (if available) when true.
 
+// EEPROM layout. Every block is [EEPROM_MAGIC][version][data...][crc8].
+#define EEPROM_MAGIC 0xA5 // First byte of every block we've written
+#define EEPROM_MAG_CAL 0 // Magnetic sensor calibration (see SensorControl)
+#define EEPROM_DRIVE_CAL 32 // Drive constants (see DriveControl)
+
 /*
 	DO NOT CALL THIS
 	This will initialize things for ardvarc, 
@@ -53,4 +60,122 @@ inline float mapf(float x, float in_min, float in_max, float out_min, float out_
   return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
 }
 
-#endif
\ No newline at end of file
+// atan(k/16) for k = 0..16, in tenths of a degree (for iatan2)
+const int __atan_table[17] PROGMEM = {
+	0, 36, 71, 106, 140, 174, 206, 236, 266, 294, 320, 345, 369, 391, 412, 432, 450
+};
+
+// Integer atan2 in whole degrees (-180 to 180), without touching floats.
+// The angle is folded into the first octant, where atan(small/big) is looked
+// up (with linear interpolation) from a small table. Good to within a degree.
+inline int iatan2(long y, long x)
+{
+	if (x == 0 && y == 0) {
+		return 0;
+	}
+	unsigned long ax = labs(x), ay = labs(y);
+	bool steep = ay > ax; // Past 45 degrees, so use the other ratio
+	unsigned long small = steep ? ax : ay;
+	unsigned long big = steep ? ay : ax;
+
+	unsigned int ratio = ((small << 8) + big / 2) / big; // 0 to 256 (Q8)
+	byte k = ratio >> 4;
+	int angle = pgm_read_word(&__atan_table[k]); // Tenths of a degree
+	if (k < 16) {
+		int next = pgm_read_word(&__atan_table[k + 1]);
+		angle += ((next - angle) * (int) (ratio & 15) + 8) >> 4;
+	}
+
+	// Unfold back out of the first octant
+	if (steep) {
+		angle = 900 - angle;
+	}
+	if (x < 0) {
+		angle = 1800 - angle;
+	}
+	angle = (angle + 5) / 10;
+	return (y < 0) ? -angle : angle;
+}
+
+// Integer square root (rounded down)
+inline unsigned int isqrt(unsigned long n)
+{
+	unsigned long root = 0;
+	unsigned long bit = 1UL << 30; // Highest power of 4 that fits
+	while (bit > n) {
+		bit >>= 2;
+	}
+	while (bit != 0) {
+		if (n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+// Brings an angle (degrees) into -180 to 180, i.e. the short way around
+inline float shortAngle(float angle)
+{
+	angle = fmod(angle, 360);
+	if (angle > 180) {
+		angle -= 360;
+	} else if (angle < -180) {
+		angle += 360;
+	}
+	return angle;
+}
+
+// CRC-8 (polynomial 0x07) of a block of bytes
+inline byte crc8(const byte * data, int len, byte crc = 0)
+{
+	for (int i = 0; i < len; ++i) {
+		crc ^= data[i];
+		for (byte bit = 0; bit < 8; ++bit) {
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+// Writes a block of data to the EEPROM at addr, with a header and checksum
+// so loadBlock can tell if it's ours (and in one piece). Only changed bytes
+// are written, to save wear.
+inline void saveBlock(int addr, byte version, const void * data, int len)
+{
+	const byte * bytes = (const byte *) data;
+	EEPROM.update(addr, EEPROM_MAGIC);
+	EEPROM.update(addr + 1, version);
+	for (int i = 0; i < len; ++i) {
+		EEPROM.update(addr + 2 + i, bytes[i]);
+	}
+	EEPROM.update(addr + 2 + len, crc8(bytes, len, crc8(&version, 1)));
+}
+
+// Reads a block written by saveBlock. Returns false (and leaves data alone)
+// if there's nothing there, it's from a different version, or the checksum
+// doesn't match.
+inline bool loadBlock(int addr, byte version, void * data, int len)
+{
+	if (EEPROM.read(addr) != EEPROM_MAGIC || EEPROM.read(addr + 1) != version) {
+		return false;
+	}
+	byte crc = crc8(&version, 1);
+	for (int i = 0; i < len; ++i) {
+		byte value = EEPROM.read(addr + 2 + i);
+		crc = crc8(&value, 1, crc);
+	}
+	if (crc != EEPROM.read(addr + 2 + len)) {
+		return false;
+	}
+	byte * bytes = (byte *) data;
+	for (int i = 0; i < len; ++i) {
+		bytes[i] = EEPROM.read(addr + 2 + i);
+	}
+	return true;
+}
+
+#endif
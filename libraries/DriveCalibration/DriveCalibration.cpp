@@ -0,0 +1,248 @@
+#include "DriveCalibration.h"
+
+// Each step measures its constants with the ones before already in use, so
+// (for example) the drive away from the wall only sees the back scaling.
+bool DriveCalibrator::calibrate(bool save)
+{
+	_cal = _driver.getCalibration();
+	_turns = _driver.getTurnSense();
+	_sense = 0;
+	_angle = 0;
+	_driver.stopAll();
+	_driver.setTurnFeedback(NULL); // Turns have to go by the clock to measure it
+	_driver.setBlending(0);
+
+	float bearing;
+	if (!readBearing(bearing)) {
+		fail("no compass readings");
+		return false;
+	}
+	int wall = readFront();
+	if (wall < CAL_WALL_MIN || wall > CAL_WALL_MAX) {
+		fail("the wall isn't in range");
+		return false;
+	}
+
+	drive_calibration before = _cal;
+	if (!measureNudge() || !measureStraight() || !measureSpin()) {
+		_driver.setCalibration(before); // Nothing half done
+		return false;
+	}
+
+	_driver.setCalibration(_cal);
+	_cal = _driver.getCalibration(); // As the driver keeps it (wheel scales normalised)
+	if (save) {
+		_driver.saveCalibration();
+	}
+	if (F_DEBUG && Serial) {
+		Serial.print("Drive calibration. rpdc: ");
+		Serial.print(_cal.rpdc);
+		Serial.print(" wheels: ");
+		Serial.print(_cal.left_scale);
+		Serial.print(", ");
+		Serial.print(_cal.right_scale);
+		Serial.print(" back: ");
+		Serial.print(_cal.back_scale);
+		Serial.print(" spin: ");
+		Serial.print(_cal.left_spin);
+		Serial.print(", ");
+		Serial.print(_cal.right_spin);
+		Serial.print(" nudge: ");
+		Serial.println(_cal.nudge_scale);
+	}
+	return true;
+}
+
+const drive_calibration & DriveCalibrator::getResult() const
+{
+	return _cal;
+}
+
+// Turns right on the left wheel (right one stopped), then back on the right
+// wheel. Going forwards on one wheel can only turn one way, so the first turn
+// also tells us which way the compass goes. Nudging wants the two the same,
+// so the nudge scale is how much further the right wheel has to go. (A wheel
+// on its own goes by its own speed, so the wheel scales don't come into it.)
+// "Right" here is whichever way the left wheel turns the car, so the arcs
+// are flipped by the driver's turn sense to keep them on the same wheels.
+bool DriveCalibrator::measureNudge()
+{
+	float left_turn;
+	float right_turn;
+	_driver.driveArc(_driver.getTrackWidth() / 2, _turns * CAL_PIVOT_ANGLE);
+	if (!runMeasured(left_turn)) {
+		return false;
+	}
+	if (abs(left_turn) < CAL_PIVOT_ANGLE / 4) {
+		fail("the compass didn't see the turn");
+		return false;
+	}
+	_sense = (left_turn > 0) ? 1 : -1;
+	_angle = _sense * left_turn;
+
+	_driver.driveArc(_driver.getTrackWidth() / 2, -_turns * CAL_PIVOT_ANGLE);
+	if (!runMeasured(right_turn)) {
+		return false;
+	}
+	if (right_turn * _sense > -CAL_PIVOT_ANGLE / 4) {
+		fail("the right wheel didn't turn the car left");
+		return false;
+	}
+	_cal.nudge_scale = abs(left_turn / right_turn);
+
+	// Square up again on whichever wheel turns back, going by how far it
+	// turned just now (the spin scales aren't measured yet)
+	float per_degree = abs((_angle > 0) ? right_turn : left_turn) / CAL_PIVOT_ANGLE;
+	_driver.driveArc(_driver.getTrackWidth() / 2, -_turns * _angle / per_degree);
+	return runMeasured(right_turn);
+}
+
+// Towards the wall, the sonar says how far it really went (so how fast the
+// wheels really are, for rpdc), and the compass says how far it drifted off
+// straight (so which wheel is faster). Then away from the wall, with those
+// fixed, for the back scaling.
+bool DriveCalibrator::measureStraight()
+{
+	float drift;
+	float angle = _angle;
+	int start = readFront();
+	_driver.forward(CAL_DRIVE_DIST);
+	if (!runMeasured(drift)) {
+		return false;
+	}
+	int middle = readFront();
+	float went = (start - middle) / towardsWall(angle);
+	if (start == 0 || middle == 0 || went < CAL_DRIVE_DIST / 4) {
+		fail("the sonar didn't see the car get closer");
+		return false;
+	}
+
+	// Turning by drift means the wheels went track * drift apart. Scale each
+	// by what it should have gone over what it did.
+	float apart = _sense * drift * PI / 180 * _driver.getTrackWidth() / 2;
+	if (abs(apart) >= went / 2) {
+		fail("it turned too much to be going straight");
+		return false;
+	}
+	_cal.left_scale /= went + apart;
+	_cal.right_scale /= went - apart;
+	// The driver times moves by the left wheel, so that's the one rpdc goes by
+	_cal.rpdc *= (went + apart) / CAL_DRIVE_DIST;
+	_driver.setCalibration(_cal);
+	_cal = _driver.getCalibration(); // Wheel scales normalised
+
+	angle = _angle;
+	_driver.backward(CAL_DRIVE_DIST);
+	if (!runMeasured(drift)) {
+		return false;
+	}
+	int end = readFront();
+	float back = (end - middle) / towardsWall(angle);
+	if (end == 0 || back < CAL_DRIVE_DIST / 4) {
+		fail("the sonar didn't see the car back away");
+		return false;
+	}
+	_cal.back_scale *= CAL_DRIVE_DIST / back;
+	_driver.setCalibration(_cal);
+	return true;
+}
+
+// Each spin scale is stretched by how far the turn should have gone over how
+// far it did. The spins go the same way as the arcs in measureNudge() (the
+// driver flips both by its turn sense), so the scales keep their sign.
+bool DriveCalibrator::measureSpin()
+{
+	float turned;
+	_driver.turnAngle(CAL_SPIN_ANGLE);
+	if (!runMeasured(turned)) {
+		return false;
+	}
+	turned *= _sense * _turns;
+	if (turned < CAL_SPIN_ANGLE / 4) {
+		fail("the right spin barely turned");
+		return false;
+	}
+	_cal.right_spin *= CAL_SPIN_ANGLE / turned;
+
+	_driver.turnAngle(-CAL_SPIN_ANGLE);
+	if (!runMeasured(turned)) {
+		return false;
+	}
+	turned *= -_sense * _turns;
+	if (turned < CAL_SPIN_ANGLE / 4) {
+		fail("the left spin barely turned");
+		return false;
+	}
+	_cal.left_spin *= CAL_SPIN_ANGLE / turned;
+	return true;
+}
+
+// Readings come in every so often, so there's one more once the car has
+// stopped to catch the end of the turn.
+bool DriveCalibrator::runMeasured(float & turned)
+{
+	float last;
+	float bearing;
+	if (!readBearing(last)) {
+		fail("no compass readings");
+		return false;
+	}
+	turned = 0;
+	_driver.run();
+	while (_driver.isDriving()) {
+		_driver.run();
+		if (_sensors.pollMagBearing(bearing)) {
+			turned += shortAngle(bearing - last);
+			last = bearing;
+		}
+	}
+	_driver.stopAll();
+	delay(CAL_SETTLE);
+	if (!readBearing(bearing)) {
+		fail("no compass readings");
+		return false;
+	}
+	turned += shortAngle(bearing - last);
+	_angle += _sense * turned;
+	return true;
+}
+
+// How much of a straight move went towards (or away from) the wall, given the
+// angle the car started at. It's taken as turning steadily to _angle, so it
+// went at the average of the two.
+float DriveCalibrator::towardsWall(float start_angle) const
+{
+	return cos((start_angle + _angle) / 2 * PI / 180);
+}
+
+bool DriveCalibrator::readBearing(float & bearing)
+{
+	unsigned long start = millis();
+	while (millis() - start < CAL_COMPASS_WAIT) {
+		if (_sensors.pollMagBearing(bearing)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The sonar filter smooths over its last few pings, so ping enough times
+// that they're all from here.
+int DriveCalibrator::readFront()
+{
+	int dist = 0;
+	for (byte i = 0; i < CAL_SONAR_READS; ++i) {
+		dist = _sensors.getFrontDistance();
+		delay(PING_INTERVAL);
+	}
+	return dist;
+}
+
+void DriveCalibrator::fail(const char * why)
+{
+	_driver.stopAll();
+	if (F_DEBUG && Serial) {
+		Serial.print("Drive calibration failed: ");
+		Serial.println(why);
+	}
+}
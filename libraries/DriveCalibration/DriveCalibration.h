@@ -0,0 +1,68 @@
+/*
+
+Measures the drive constants that are otherwise tuned by hand (rpdc, wheel
+scales, back scaling, spin scales and the nudge scale), using the front sonar
+and the compass, and saves them to EEPROM for DriveControl to load at startup
+(see loadCalibration()).
+
+The car needs to be facing a wall (square on, CAL_WALL_MIN to CAL_WALL_MAX mm
+away), with room to spin, and away from magnets and steel. Calibrate the
+magnetic sensor first (see SensorControl), or the turns won't measure right.
+Turn feedback and blending are switched off on the driver, so set them again
+afterwards if the sketch uses them.
+
+See the README for the steps and how each constant is worked out.
+
+*/
+
+#ifndef drivecalibration_h
+#define drivecalibration_h
+
+// Pull in the Arduino standard libraries
+#if ARDUINO >= 100
+  #include "Arduino.h"
+#else
+  #include "WProgram.h"
+  #include "pins_arduino.h"
+  #include "WConstants.h"
+#endif
+
+#include <DriveControl.h>
+#include <SensorControl.h>
+#include <ARDVARC_UTIL.h>
+
+#define CAL_DRIVE_DIST 300 // mm driven towards (and back away from) the wall
+#define CAL_PIVOT_ANGLE 90 // Degrees for each turn on one wheel
+#define CAL_SPIN_ANGLE 180 // Degrees for each turn on the spot
+#define CAL_WALL_MIN 550 // Closest (mm) the wall can be at the start (it gets a track width closer, then the drive)
+#define CAL_WALL_MAX 1500 // Furthest (mm) the wall can be, for a good sonar reading
+#define CAL_SONAR_READS FILTER_MAX_WINDOW // Sonar readings per distance (enough that the filter only remembers this spot)
+#define CAL_SETTLE 300 // ms to wait after each move, for the car to stop rocking
+#define CAL_COMPASS_WAIT 500 // Longest (ms) to wait for a compass reading
+
+class DriveCalibrator
+{
+public:
+	DriveCalibrator(DriveControl & driver, SensorControl & sensors) : _driver(driver), _sensors(sensors) {};
+
+	bool calibrate(bool save = true); // Runs every step (takes about a minute). False (and the driver left as it was) if it couldn't measure something.
+	const drive_calibration & getResult() const; // What it worked out (also set on the driver)
+private:
+	DriveControl & _driver;
+	SensorControl & _sensors;
+	drive_calibration _cal; // Starts as the driver's, and each step updates its part
+	char _sense = 0; // 1 if the bearing goes up turning right, -1 if down
+	short _turns = 1; // The driver's turn sense (driveArc() and turnAngle() go the other way if -1)
+	float _angle = 0; // Degrees the car is turned right of square to the wall (once _sense is known)
+
+	bool measureNudge(); // Turns on each wheel in turn (also works out _sense), then squares up to the wall
+	bool measureStraight(); // Drives towards the wall, then away
+	bool measureSpin(); // Turns on the spot each way
+	bool runMeasured(float & turned); // Runs the queue to the end, adding up how far the compass turns
+	bool readBearing(float & bearing); // Waits for a new compass reading
+	float towardsWall(float start_angle) const; // Fraction of the last straight move that went along the wall's normal
+	int readFront(); // Front sonar distance (mm) once the car has stopped, 0 if there wasn't an echo
+	void fail(const char * why); // Stops, and says why (if debugging)
+};
+
+#endif
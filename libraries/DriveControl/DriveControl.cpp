@@ -2,6 +2,8 @@
 
 #define PI 3.141592 // Needed for rotational calculations
 
+DriveControl * DriveControl::_timer_owner = NULL;
+
 /*
 
 Parameter Setting
@@ -10,43 +12,152 @@ Parameter Setting
 
 void DriveControl::setMotorPins(int en1, int in1, int in2, int en2, int in3, int in4)
 {
+	hold();
 	_motors.setLeft(en1, in1, in2);
 	_motors.setRight(en2, in3, in4);
+	release();
 }
 
 // Set the internal speed scalar to a value between 0 and 1.
 void DriveControl::setSpeed(float speed)
 {
+	hold();
 	_global_speed_scalar = constrain(speed, 0, 1);
+	release();
 }
 
 // Set the internal backwards speed scalar
 void DriveControl::setBackScaling(float speed)
 {
+	hold();
 	_back_scalar = constrain(speed, 0, 5);
+	release();
 }
 
-void DriveControl::setWheelScales(float left, float right) {
+void DriveControl::setWheelScales(float left, float right)
+{
+	hold();
 	float normalizer = 1.0 / max(left, right);
 	_left_scalar = left * normalizer;
 	_right_scalar = right * normalizer;
+	release();
 }
 
 // Set the internal rpm (for 100% duty cycle) to a value. 
 // This cannot be negative, but it can be zero (but then the whole car is useless).
 void DriveControl::setRevsPerDC(float rpdc)
 {
+	hold();
 	_rpdc = max(rpdc, 0);
+	release();
 }
 
 void DriveControl::setWheelDiameter(float wheel)
 {
+	hold();
 	_wheel_dia = max(wheel, 1E-4);
+	release();
 }
 
 void DriveControl::setTrackWidth(float track)
 {
+	hold();
 	_track = max(track, 1E-4);
+	release();
+}
+
+// These can't be negative. 0 turns them off.
+void DriveControl::setAcceleration(float accel)
+{
+	hold();
+	_accel = max(accel, 0);
+	release();
+}
+
+void DriveControl::setJerk(float jerk)
+{
+	hold();
+	_jerk = max(jerk, 0);
+	release();
+}
+
+// These are signed: negative ones mean the car turns the other way to what the
+// wheels say (e.g. the motors are swapped). That goes for every turn, not just
+// the spins, so the sign is kept apart (they should both have the same one, but
+// if not, the bigger wins).
+void DriveControl::setSpinScales(float left, float right)
+{
+	hold();
+	_left_spin = abs(left);
+	_right_spin = abs(right);
+	_turn_sense = (left + right < 0) ? -1 : 1;
+	release();
+}
+
+void DriveControl::setNudgeScale(float scale)
+{
+	hold();
+	_nudge_scale = max(scale, 0);
+	release();
+}
+
+float DriveControl::getTrackWidth() const
+{
+	return _track;
+}
+
+short DriveControl::getTurnSense() const
+{
+	return _turn_sense;
+}
+
+/*
+
+Calibration
+
+The constants that depend on the motors (and the floor) are kept in EEPROM,
+so one car can be measured once (see the DriveCalibration library) and every
+sketch picks them up. Whatever the sketch sets is used if there's nothing
+saved.
+
+*/
+
+drive_calibration DriveControl::getCalibration() const
+{
+	drive_calibration cal;
+	cal.rpdc = _rpdc;
+	cal.left_scale = _left_scalar;
+	cal.right_scale = _right_scalar;
+	cal.back_scale = _back_scalar;
+	cal.left_spin = _left_spin * _turn_sense;
+	cal.right_spin = _right_spin * _turn_sense;
+	cal.nudge_scale = _nudge_scale;
+	return cal;
+}
+
+void DriveControl::setCalibration(const drive_calibration & cal)
+{
+	setRevsPerDC(cal.rpdc);
+	setWheelScales(cal.left_scale, cal.right_scale);
+	setBackScaling(cal.back_scale);
+	setSpinScales(cal.left_spin, cal.right_spin);
+	setNudgeScale(cal.nudge_scale);
+}
+
+bool DriveControl::loadCalibration()
+{
+	drive_calibration cal;
+	if (!loadBlock(EEPROM_DRIVE_CAL, DRIVE_CAL_VERSION, &cal, sizeof(cal))) {
+		return false;
+	}
+	setCalibration(cal);
+	return true;
+}
+
+void DriveControl::saveCalibration()
+{
+	drive_calibration cal = getCalibration();
+	saveBlock(EEPROM_DRIVE_CAL, DRIVE_CAL_VERSION, &cal, sizeof(cal));
 }
 
 /*
@@ -83,7 +194,39 @@ void DriveControl::pause(int duration) {
 	pause_inst.duration = duration; // In milliseconds
 	// Keep other struct variables as given (defaults)
 
-	queue.push(pause_inst);
+	queueInstruction(pause_inst);
+}
+
+/*
+
+Scripted motion
+
+*/
+
+// Scripts are read straight out of flash, a step at a time (in run()), so
+// nothing is copied into memory here.
+void DriveControl::runScript(const byte * script)
+{
+	hold();
+	_script = script;
+	_script_speed = 1;
+	loadScript();
+	release();
+}
+
+void DriveControl::setScriptAction(void (*action)(byte id))
+{
+	hold();
+	_script_action = action;
+	release();
+}
+
+bool DriveControl::isScriptRunning() const
+{
+	noInterrupts();
+	bool running = _script != NULL;
+	interrupts();
+	return running;
 }
 
 /*
@@ -96,7 +239,7 @@ Rotational Motion
 // distances (arc-lengths). Speed will be the max given by the speed_scalar
 void DriveControl::turnAngle(float theta, float speed_scalar = 1)
 {
-	if (F_DEBUG && Serial) {
+	if (canPrint()) {
 		Serial.print("Turn. Theta: ");
 		Serial.println(theta);
 	}
@@ -106,7 +249,12 @@ void DriveControl::turnAngle(float theta, float speed_scalar = 1)
 		return;
 	}
 
+	queueInstruction(spinInstruction(theta, speed_scalar));
+}
 
+// Makes the instruction for turnAngle(), without queueing it
+drive_instruction DriveControl::spinInstruction(float theta, float speed_scalar)
+{
 	// Calculate circumference of turning circle
 	float turn_circ = PI * _track;
 
@@ -115,9 +263,9 @@ void DriveControl::turnAngle(float theta, float speed_scalar = 1)
 
 	// Correct with scaling factors, depending on direction we're turning
 	if (theta > 0) {
-		arc_len *= R_SPIN_SCALE;
+		arc_len *= _right_spin;
 	} else {
-		arc_len *= L_SPIN_SCALE;
+		arc_len *= _left_spin;
 	}
 
 	// Determine direction of rotation
@@ -127,10 +275,10 @@ void DriveControl::turnAngle(float theta, float speed_scalar = 1)
 	} else { // Then we are turning LEFT, so right wheel forward
 		director = -1;
 	}
+	director *= _turn_sense; // Unless the car turns the other way
 
-	// Add the instruction to the queue. Right always opposes left at same speed.
-	addInstruction(arc_len * director, -1 * arc_len * director, speed_scalar);
-
+	// Make the instruction. Right always opposes left at same speed.
+	return newInstruction(arc_len * director, -1 * arc_len * director, speed_scalar);
 }
 
 // Equivalent: a function alias
@@ -145,6 +293,15 @@ void DriveControl::turnLeft(float theta, float speed_scalar = 1)
 	turnAngle(-1 * theta, speed_scalar);
 }
 
+// With a heading source, turns on the spot go until the compass says they're
+// done, rather than for a set time. See steerFeedbackTurn().
+void DriveControl::setTurnFeedback(bool (*source)(float & heading))
+{
+	hold();
+	_turn_source = source;
+	release();
+}
+
 // Does what it says.
 void DriveControl::turnAround(float speed_scalar = 1)
 {
@@ -169,25 +326,88 @@ void DriveControl::goToPoint(float x, float y, float speed_scalar = 1)
 	goToPointSticky(x, y, speed_scalar);
 
 	// Find angle to rotate back by
-	Coordinates coords(x, y);
-	if (abs(coords.getAngle()) > 0) {
-		turnAngle(-1 * coords.getAngle() * 180/PI, speed_scalar);
+	float bearing = atan2(x, y) * 180/PI;
+	if (abs(bearing) > 0) {
+		turnAngle(-1 * bearing, speed_scalar);
 	}
 }
 
 void DriveControl::goToPointSticky(float x, float y, float speed_scalar = 1)
 {
-	// Perform polar convserion
+	// Perform polar convserion. The angle is to the right of straight ahead
+	// (y is forwards), like arcToPoint(), not Coordinates' angle from the x axis.
 	Coordinates coords(x, y);
+	float bearing = atan2(x, y) * 180/PI;
 
 	// With polar attributes, now execute minimal instruction set:
-	if (abs(coords.getAngle()) > 0) {
-		turnAngle(coords.getAngle() * 180/PI, speed_scalar);
+	if (abs(bearing) > 0) {
+		turnAngle(bearing, speed_scalar);
 	}
 
 	forward(coords.getR(), speed_scalar);
 }
 
+// Both wheels are set going at once (at speeds in the ratio of their
+// distances), so the car follows the circle the whole way instead of stopping
+// to turn. A radius of 0 is a turn on the spot.
+void DriveControl::driveArc(float radius, float theta, float speed_scalar)
+{
+	if (radius == 0) {
+		turnAngle(theta, speed_scalar);
+		return;
+	}
+	queueInstruction(arcInstruction(radius, theta, speed_scalar));
+}
+
+// The middle of the car goes around a circle of the given radius, so the
+// outside wheel goes around one half a track wider, and the inside one half a
+// track tighter (backwards, if the radius is less than half a track).
+drive_instruction DriveControl::arcInstruction(float radius, float theta, float speed_scalar)
+{
+	float angle = abs(theta) * PI / 180;
+	float outside = (abs(radius) + _track / 2) * angle;
+	float inside = (abs(radius) - _track / 2) * angle;
+
+	if (theta * _turn_sense > 0) {
+		return newInstruction(outside, inside, speed_scalar);
+	}
+	return newInstruction(inside, outside, speed_scalar);
+}
+
+// Where goToPointSticky() turns and then drives, this finds the circle the
+// car is already heading along that goes through the point, so it's one
+// motion. The car turns by twice the angle to the point on the way.
+float DriveControl::arcToPoint(float x, float y, float speed_scalar)
+{
+	if (abs(x) < 1) {
+		forward(y, speed_scalar); // Straight ahead (or behind)
+		return 0;
+	}
+	float bearing = atan2(x, y); // To the right of straight ahead (radians)
+	float chord = sqrt(x * x + y * y);
+	float theta = bearing * 2 * 180 / PI;
+	driveArc(chord / 2 / sin(abs(bearing)), theta, speed_scalar);
+	return theta;
+}
+
+// Each arc starts off facing the way the last one finished, so the path is
+// smooth all the way. Keeps track of where the car will be after each arc
+// to work out the next point relative to it.
+void DriveControl::followPath(const float points[][2], byte count, float speed_scalar)
+{
+	float x = 0;
+	float y = 0;
+	float heading = 0;
+	for (byte i = 0; i < count; ++i) {
+		float dx = points[i][0] - x;
+		float dy = points[i][1] - y;
+		float rad = heading * PI / 180;
+		heading += arcToPoint(dx * cos(rad) - dy * sin(rad), dx * sin(rad) + dy * cos(rad), speed_scalar);
+		x = points[i][0];
+		y = points[i][1];
+	}
+}
+
 // Uses two arcs to move horizontally, and then corrects the vertical.
 // This function uses a very specific algorithm, meant for SHORT movements.
 // Longer paths won't work with this algorithm.
@@ -219,14 +439,14 @@ void DriveControl::nudge(float x, float y, float speed_scalar = 1)
 	// Determine the motion based on the sign of x
 	if (x > 0) { // Left wheel first
 		addInstruction(wheel_dist, 0, speed_scalar);
-		addInstruction(0, NR_SCALE * wheel_dist, speed_scalar);
+		addInstruction(0, _nudge_scale * wheel_dist, speed_scalar);
 	} else { // Right wheel first
-		addInstruction(0, NR_SCALE * wheel_dist, speed_scalar);
+		addInstruction(0, _nudge_scale * wheel_dist, speed_scalar);
 		addInstruction(wheel_dist, 0, speed_scalar);
 	} // If x == 0, do nothing.
 
 	// Do vertical correction
-	forward(NR_SCALE * vert_correct, speed_scalar);
+	forward(_nudge_scale * vert_correct, speed_scalar);
 }
  
 
@@ -240,22 +460,214 @@ Utility Functions
 
 void DriveControl::stopAll()
 {
-	// Remove any remaining instructions.
-	while (queue.count() > 0) {
-		queue.pop(); 
-	}
-	executeInstruction(empty_instruction);
+	// Remove any remaining instructions (and the rest of the script).
+	hold();
+	queue.clear();
+	_script = NULL;
+	_action_pending = false;
+	_waypoints.clear();
+	_pursuing = false;
+	stopWheels();
+	release();
 }
 
 
 bool DriveControl::isDriving() const
 {
-	 // This is modified only by the run() method when adding/expiring instructions from the front of the queue.
-	return _driving;
+	// _driving is modified only by the run() method when adding/expiring instructions from the front of the queue.
+	// Anything still waiting counts too, since the timer interrupt may not have started it yet.
+	runPendingAction();
+	noInterrupts();
+	bool driving = _driving || queue.count() > 0 || _script != NULL || _pursuing;
+	interrupts();
+	return driving;
+}
+
+// Timer 0 already ticks (about) once a ms for millis(), so the timer
+// interrupt borrows its compare match A rather than taking timer 1 (Servo) or
+// timer 2 (NewPing). That matches once a cycle whatever OCR0A is set to, so
+// OCR0A is left alone: nothing about timer 0 changes, and millis(), delay()
+// and PWM on pins 5 and 6 work as before.
+bool DriveControl::beginTimer()
+{
+#if defined(__AVR__)
+	noInterrupts();
+	_timer_owner = this;
+	_ticks = 0;
+	TIMSK0 |= _BV(OCIE0A);
+	interrupts();
+	return true;
+#else
+	return false;
+#endif
+}
+
+void DriveControl::endTimer()
+{
+#if defined(__AVR__)
+	noInterrupts();
+	if (_timer_owner == this) {
+		TIMSK0 &= ~_BV(OCIE0A);
+		_timer_owner = NULL;
+	}
+	interrupts();
+#endif
+}
+
+bool DriveControl::isTimerRunning() const
+{
+	return _timer_owner == this;
+}
+
+// Runs every DRIVE_TICK interrupts. If the sketch is in the middle of changing
+// the queue (or reading the pose), the run waits for the next tick instead.
+void DriveControl::handleTimer()
+{
+	DriveControl * self = _timer_owner;
+	if (self == NULL || ++self->_ticks < DRIVE_TICK || self->_hold > 0) {
+		return;
+	}
+	self->_ticks = 0;
+	self->_hold = 1;
+	self->_in_timer = true;
+	self->run();
+	self->_in_timer = false;
+	self->_hold = 0;
+}
+
+// The wheels aren't measured, so this is worked out from how fast we've told
+// them to go (and for how long). Turning on the spot doesn't add anything.
+float DriveControl::getDistanceTravelled()
+{
+	hold();
+	updateOdometry();
+	float travelled = _travelled;
+	release();
+	return travelled;
+}
+
+void DriveControl::resetDistanceTravelled()
+{
+	hold();
+	updateOdometry();
+	_travelled = 0;
+	release();
+}
+
+// As above, this is worked out from the wheel speeds. Turns on the spot go
+// by the angle that was asked for (so the spin scales are taken back out).
+float DriveControl::getHeading()
+{
+	hold();
+	updateOdometry();
+	float heading = _heading;
+	release();
+	return heading;
+}
+
+void DriveControl::resetHeading()
+{
+	hold();
+	updateOdometry();
+	_heading = 0;
+	release();
+}
+
+// The pose is kept up to date as the car drives (every run()), and only
+// changes otherwise when it's corrected. On the timer, it can change while
+// it's being read, so use getX() and getY() there.
+const drive_pose & DriveControl::getPose()
+{
+	hold();
+	updateOdometry();
+	release();
+	return _pose;
+}
+
+float DriveControl::getX()
+{
+	hold();
+	float x = getPose().x;
+	release();
+	return x;
+}
+
+float DriveControl::getY()
+{
+	hold();
+	float y = getPose().y;
+	release();
+	return y;
+}
+
+void DriveControl::setPose(float x, float y, float heading)
+{
+	hold();
+	updateOdometry();
+	_pose = drive_pose();
+	_pose.x = x;
+	_pose.y = y;
+	_pose.heading = heading;
+	release();
+}
+
+void DriveControl::setPoseNoise(float dist, float turn, float drift)
+{
+	hold();
+	_dist_noise = max(dist, 0);
+	_turn_noise = max(turn, 0);
+	_drift_noise = max(drift, 0);
+	release();
+}
+
+void DriveControl::correctX(float x, float variance)
+{
+	hold();
+	updateOdometry();
+	correctPose(0, x - _pose.x, variance);
+	release();
+}
+
+void DriveControl::correctY(float y, float variance)
+{
+	hold();
+	updateOdometry();
+	correctPose(1, y - _pose.y, variance);
+	release();
+}
+
+// Compass headings wrap around, so take the short way to the measurement
+void DriveControl::correctHeading(float heading, float variance)
+{
+	hold();
+	updateOdometry();
+	correctPose(2, shortAngle(heading - _pose.heading), variance);
+	release();
 }
 
 // PRIVATE 
 
+// Taking a hold doesn't stop interrupts, it just makes the timer's run() skip
+// a tick, so a long calculation here doesn't upset the sonars or servos.
+void DriveControl::hold()
+{
+	noInterrupts();
+	++_hold;
+	interrupts();
+}
+
+void DriveControl::release()
+{
+	noInterrupts();
+	--_hold;
+	interrupts();
+}
+
+bool DriveControl::canPrint() const
+{
+	return F_DEBUG && Serial && !_in_timer;
+}
+
 // Return true if positive or 0, false if negative
 bool DriveControl::boolsgn(float num)
 {
@@ -283,7 +695,19 @@ Instruction and Queue Logic:
 // Takes required wheel distances, creates an instruction and pushes it onto the end of the queue.
 void DriveControl::addInstruction(float left_dist, float right_dist, float speed_scalar = 1)
 {
-	queue.push(newInstruction(left_dist, right_dist, speed_scalar));
+	queueInstruction(newInstruction(left_dist, right_dist, speed_scalar));
+}
+
+// The queue is a fixed size, so a full queue turns new instructions away
+// rather than running out of memory. Call run() (or control()) more often
+// than DRIVE_QUEUE_SIZE instructions apart.
+void DriveControl::queueInstruction(const drive_instruction & inst)
+{
+	hold();
+	if (!blendInstruction(inst) && !queue.push(inst) && canPrint()) {
+		Serial.println("Drive queue full, instruction dropped");
+	}
+	release();
 }
 
 
@@ -293,30 +717,43 @@ drive_instruction DriveControl::newInstruction(float left_dist, float right_dist
 {
 	// The fastest speed that a wheel can possibly travel in this system.
 	// Note that this should never equal 0, or we will have a problem. (this is in mm/s)
-	float max_velocity = (_rpdc / 60) * _wheel_dia * PI; // Convert rpm to rps, then to a distance with dia*pi.
+	float max_velocity = maxVelocity();
 
 	if (max_velocity <= 0) {
 		// Do nothing. If we get to here, something went wrong with setting parameters.
 		return empty_instruction;
 	}
 
-	// Work out relative scales of the speeds. Be aware of division by 0.
-	float left_speed = (abs(left_dist) > 0) ? left_dist / abs(left_dist) : 0;
-	float right_speed = (abs(right_dist) > 0) ? right_dist / abs(right_dist) : 0;
-	float normalizer = 1 / abs(max(left_speed, right_speed)); // Need to use this to cap the speeds at "1"
+	// Work out relative scales of the speeds, so both wheels finish together
+	// (the longer distance goes at full speed). Be aware of division by 0.
+	float longest = max(abs(left_dist), abs(right_dist));
+	if (longest <= 0) {
+		return empty_instruction;
+	}
+	float left_speed = left_dist / longest;
+	float right_speed = right_dist / longest;
 
 	// Must be within range for this to work, also modified by global
 	// settings. This is the operative scalar that modifies the relative
 	// weighted speeds.
-	speed_scalar = normalizer * constrain(speed_scalar, 0, 1) * _global_speed_scalar * max_velocity; 
+	speed_scalar = constrain(speed_scalar, 0, 1) * _global_speed_scalar * max_velocity; 
+
+	// With ramps, the instruction has to be long enough to fit half a ramp at
+	// each end (from and to a stop, at worst). Slow down short moves until it is.
+	if (_accel > 0) {
+		float a_over_j = (_jerk > 0) ? _accel / _jerk : 0;
+		float fits = _accel / 2 * (sqrt(a_over_j * a_over_j + 4 * longest / _accel) - a_over_j);
+		speed_scalar = min(speed_scalar, fits);
+	}
 
 	// Scale the speeds to the right dimensions, and scale by required modifiers
 	left_speed  *= speed_scalar * _left_scalar; // left_scalar is an adjuster to keep it straight
 	right_speed *= speed_scalar * _right_scalar;
 
 	// Normalize results to have a max at the max_speed, then map to -255 -> 255
-	int left_analog = int(mapf(left_speed, -max_velocity, max_velocity, -255, 255));
-	int right_analog = int(mapf(right_speed, -max_velocity, max_velocity, -255, 255));
+	// (rounded, so full speed is 255 and arcs keep their wheel ratio)
+	int left_analog = lround(mapf(left_speed, -max_velocity, max_velocity, -255, 255));
+	int right_analog = lround(mapf(right_speed, -max_velocity, max_velocity, -255, 255));
 
 	// Time needed to travel full distance of either wheel (remember that t is const)
 	float time_needed;
@@ -330,7 +767,7 @@ drive_instruction DriveControl::newInstruction(float left_dist, float right_dist
 
 	// If we're going backwards, apply the back scalar for how much extra time we need
 	if (left_speed < 0 && right_speed < 0) {
-		time_needed *= time_needed * _back_scalar;
+		time_needed *= _back_scalar;
 	}
 
 	// Build instruction from previous calculations
@@ -346,7 +783,7 @@ drive_instruction DriveControl::newInstruction(float left_dist, float right_dist
 
 void DriveControl::executeInstruction(drive_instruction inst) const
 {
-	if (F_DEBUG && Serial) {
+	if (canPrint()) {
 		Serial.print("L:");
 		Serial.print(sgnbool(inst.left_direction) * inst.left_speed);
 		Serial.print(", R:");
@@ -358,41 +795,247 @@ void DriveControl::executeInstruction(drive_instruction inst) const
 	_motors.right(sgnbool(inst.right_direction) * inst.right_speed);
 }
 
+// Convert rpm to rps, then to a distance with dia*pi.
+float DriveControl::maxVelocity() const
+{
+	return (_rpdc / 60) * _wheel_dia * PI;
+}
+
+void DriveControl::updateOdometry()
+{
+	unsigned long now = millis();
+	if (now == _odo_time) {
+		return;
+	}
+	float dist = (_left_vel + _right_vel) / 2 * (now - _odo_time);
+	float turn = _turn_rate * (now - _odo_time);
+	_travelled += dist;
+	_heading += turn;
+	_odo_time = now;
+	advancePose(dist, turn);
+}
+
+// Drives the pose along the average heading of the step. The covariance goes
+// through the same motion (P = F P F' + Q), where F says how a heading error
+// swings the position, and Q is the noise from this step.
+void DriveControl::advancePose(float dist, float turn)
+{
+	if (dist == 0 && turn == 0) {
+		return;
+	}
+
+	float mid = (_pose.heading + turn / 2) * PI / 180;
+	float s = sin(mid);
+	float c = cos(mid);
+	_pose.x += dist * s;
+	_pose.y += dist * c;
+	_pose.heading += turn;
+
+	float F[3][3] = {
+		{1, 0, dist * c * PI / 180},
+		{0, 1, -dist * s * PI / 180},
+		{0, 0, 1}
+	};
+	float FP[3][3];
+	for (byte r = 0; r < 3; ++r) {
+		for (byte k = 0; k < 3; ++k) {
+			FP[r][k] = F[r][0] * _pose.cov[0][k] + F[r][1] * _pose.cov[1][k] + F[r][2] * _pose.cov[2][k];
+		}
+	}
+	for (byte r = 0; r < 3; ++r) {
+		for (byte k = 0; k < 3; ++k) {
+			_pose.cov[r][k] = FP[r][0] * F[k][0] + FP[r][1] * F[k][1] + FP[r][2] * F[k][2];
+		}
+	}
+
+	// Distance errors are along the way we're going, heading errors grow with
+	// turning (and a little with driving)
+	float q = _dist_noise * abs(dist);
+	_pose.cov[0][0] += q * s * s;
+	_pose.cov[0][1] += q * s * c;
+	_pose.cov[1][0] += q * s * c;
+	_pose.cov[1][1] += q * c * c;
+	_pose.cov[2][2] += _turn_noise * abs(turn) + _drift_noise * abs(dist);
+}
+
+// One part (i) of the pose has been measured. Standard Kalman filter update:
+// the gain weighs the measurement against how unsure we are, and the other
+// parts of the pose move too, as far as they're correlated with it.
+void DriveControl::correctPose(byte i, float innovation, float variance)
+{
+	float total = _pose.cov[i][i] + max(variance, 1E-6);
+	float gain[3];
+	float row[3];
+	for (byte r = 0; r < 3; ++r) {
+		gain[r] = _pose.cov[r][i] / total;
+		row[r] = _pose.cov[i][r];
+	}
+
+	_pose.x += gain[0] * innovation;
+	_pose.y += gain[1] * innovation;
+	_pose.heading += gain[2] * innovation;
+	for (byte r = 0; r < 3; ++r) {
+		for (byte k = 0; k < 3; ++k) {
+			_pose.cov[r][k] -= gain[r] * row[k];
+		}
+	}
+}
+
+// Works out the wheel speeds (in mm/ms) that an instruction sets. This
+// undoes the mapping in newInstruction().
+void DriveControl::trackInstruction(const drive_instruction & inst)
+{
+	trackSpeeds(sgnbool(inst.left_direction) * inst.left_speed, sgnbool(inst.right_direction) * inst.right_speed);
+}
+
+void DriveControl::trackSpeeds(float left, float right)
+{
+	updateOdometry();
+	float scale = maxVelocity() / 255 / 1E3;
+	_left_vel = left * scale;
+	_right_vel = right * scale;
+	_turn_rate = turnRate(left, right);
+}
+
+// How fast (degrees/ms) the car turns with these wheel speeds (-255 to 255).
+// Spinning on the spot goes through the spin scales in turnAngle(), so
+// undo them to get back to the angle that was asked for. Tight arcs turn a
+// wheel backwards too, but they weren't scaled, so only spins are undone.
+float DriveControl::turnRate(float left, float right) const
+{
+	float rate = _turn_sense * (left - right); // Positive is a right turn
+	float spin_scale = 1;
+	if (isSpinSpeeds(left, right)) {
+		spin_scale = (rate > 0) ? _right_spin : _left_spin;
+	}
+	return rate * (maxVelocity() / 255 / 1E3) * 180 / (PI * _track * spin_scale);
+}
+
+// Signed wheel speeds (-255 to 255) of an instruction
+static float leftOf(const drive_instruction & inst)
+{
+	return inst.left_direction ? inst.left_speed : -inst.left_speed;
+}
+
+static float rightOf(const drive_instruction & inst)
+{
+	return inst.right_direction ? inst.right_speed : -inst.right_speed;
+}
+
 void DriveControl::run()
 {
+	// On the timer, only the interrupt runs the queue (see beginTimer())
+	if (_timer_owner == this && !_in_timer) {
+		runPendingAction();
+		return;
+	}
+
+	updateOdometry(); // Keeps the pose moving
+	updateRamp();
+	loadScript();
+
+	// Once the queue's empty, the waypoint follower takes over
+	if (_pursuing && queue.count() <= 0) {
+		steerPursuit();
+		return;
+	}
+
+	// The last instruction's done, but the car might still be slowing down
+	// (or the script is waiting on an action, and has more to come)
+	if (queue.count() <= 0 && _driving && !_ramp.active && !_action_pending) {
+		_driving = false;
+		stopAll();
+	}
+
 	// Loop through items, only moving on to the next if the current one has expired
 	while (queue.count() > 0)
 	{
 		// Get a pointer to the current instruction, so we can read/change it
 		drive_instruction * active_instruction = queue.peek();
+		bool heading_for = isHeadingFor(leftOf(*active_instruction), rightOf(*active_instruction));
+		bool feedback = isFeedbackTurn(*active_instruction);
 
 		// Start the instruction (if necessary)
 		if (active_instruction->start_time <= 0) {
+			// With ramps, the wheels have to finish the last change first
+			if (_ramp.active && !heading_for) {
+				_driving = true;
+				break;
+			}
 			// Set start time to "right now"
 			active_instruction->start_time = millis();
+			if (feedback) {
+				beginFeedbackTurn(*active_instruction);
+			}
 			// Execute the instruction (and set a flag for external use)
-			executeInstruction(*active_instruction); // Make sure to de-reference pointer
+			startInstruction(active_instruction);
 			_driving = true;
 		}
 
 		// Check to see if current instruction has expired
+		// (with ramps, hold on until the wheels have got up to speed)
 		time_passed = millis() - active_instruction->start_time;
 
-		if (
-			active_instruction->duration == 0 or 
-			(time_passed > active_instruction->duration and time_passed < millis())
-		   ) {
+		bool expired;
+		if (feedback) {
+			expired = steerFeedbackTurn(*active_instruction, time_passed);
+		} else {
+			expired = active_instruction->duration == 0 or 
+				(time_passed > active_instruction->duration and time_passed < millis() and !(_ramp.active && heading_for));
+		}
+
+		if (expired) {
+			// A turn with feedback stops where it is (it's already slowed right down)
+			if (feedback) {
+				stopWheels();
+			}
+
 			// If so, remove it from the queue and unset the _driving flag
-			queue.pop();
+			queue.drop(); // The slot isn't reused until the next push, so active_instruction is still good
 			_driving = false;
-			Serial.println(active_instruction->duration);
-			Serial.println(time_passed);
+			if (canPrint()) {
+				Serial.println(active_instruction->duration);
+				Serial.println(time_passed);
+			}
+			loadScript();
 			// That may have been the only instruction. If it was, stop the car
+			// (once it's finished slowing down), unless there are waypoints to
+			// follow or the script is waiting on an action (it's stopped already).
 			if (queue.count() <= 0)	{
+				if (_pursuing || _action_pending) {
+					break;
+				}
+				if (_accel > 0 && !isHeadingFor(0, 0)) {
+					startRamp(0, 0);
+				}
+				if (_ramp.active) {
+					_driving = true;
+					break;
+				}
 				stopAll();
 			}
 			continue;
 		} else {
+			// With ramps, start heading for the next speed half a ramp before
+			// this instruction ends, and finish half a ramp after. What's lost
+			// on one side is made up on the other, so distances stay the same.
+			// (Turns with feedback don't know when they'll end, so they stop.)
+			if (_accel > 0 && !_ramp.active && !feedback) {
+				drive_instruction * next = queue.at(1);
+				float left = next ? leftOf(*next) : 0;
+				float right = next ? rightOf(*next) : 0;
+				if (left * _left_out < 0 || right * _right_out < 0) {
+					left = 0; // A wheel can't change direction in one go, so stop first
+					right = 0;
+				}
+				if (!isHeadingFor(left, right)) {
+					float change = max(abs(left - _left_out), abs(right - _right_out)) * maxVelocity() / 255;
+					if (time_passed + rampTime(change) / 2 >= active_instruction->duration) {
+						startRamp(left, right);
+					}
+				}
+			}
+
 			// If instruction not expired, then yield from loop. 
 			// This function will be called again, and we can check then.
 			break;
@@ -400,10 +1043,592 @@ void DriveControl::run()
 	}
 }
 
-// Just loop through every item in the queue and remove it.
+// Remove every item in the queue (but the one that's running).
 void DriveControl::clearQueue()
 {
-	while(queue.count() > 1) { // Keep first instruction 
-		queue.pop();
+	hold();
+	queue.truncate(1); // Keep first instruction
+	_script = NULL;
+	_action_pending = false;
+	release();
+}
+
+// Two bytes of a script (low byte first) back into a number
+static int scriptInt(const byte * p)
+{
+	return int16_t(pgm_read_byte(p) | (pgm_read_byte(p + 1) << 8));
+}
+
+// Queues the script's next steps, keeping a couple waiting behind the running
+// instruction so there's no gap between them (and so they can be blended). An action step has to wait
+// until everything before it is done (and the car has stopped).
+void DriveControl::loadScript()
+{
+	while (_script != NULL && !_action_pending && queue.count() < DRIVE_LOOKAHEAD) {
+		byte op = pgm_read_byte(_script);
+		const byte * arg = _script + 1;
+
+		switch (op) {
+		case DRIVE_OP_FORWARD:
+			forward(scriptInt(arg), _script_speed);
+			_script += 3;
+			break;
+		case DRIVE_OP_TURN:
+			turnAngle(scriptInt(arg), _script_speed);
+			_script += 3;
+			break;
+		case DRIVE_OP_ARC:
+			driveArc(scriptInt(arg), scriptInt(arg + 2), _script_speed);
+			_script += 5;
+			break;
+		case DRIVE_OP_PAUSE:
+			pause(scriptInt(arg));
+			_script += 3;
+			break;
+		case DRIVE_OP_SPEED:
+			_script_speed = pgm_read_byte(arg) / 100.0;
+			_script += 2;
+			break;
+		case DRIVE_OP_ACTION:
+			if (queue.count() > 0 || _ramp.active) {
+				return; // Come back when the car's stopped
+			}
+			stopWheels();
+			_script += 2;
+			if (_script_action != NULL && _in_timer) {
+				_action_id = pgm_read_byte(arg);
+				_action_pending = true; // The action can't block in here, so the sketch calls it
+			} else if (_script_action != NULL) {
+				_script_action(pgm_read_byte(arg));
+			}
+			break;
+		default: // DRIVE_OP_END (or something that isn't a step)
+			_script = NULL;
+			break;
+		}
 	}
-}
\ No newline at end of file
+}
+
+// Actions (moving the arm, say) can take a while and use delay(), so on the
+// timer they're called from the sketch's side, in run() or isDriving(). The
+// script waits until the action has returned.
+void DriveControl::runPendingAction() const
+{
+	if (!_action_pending || _in_timer) {
+		return;
+	}
+	if (_script_action != NULL) {
+		_script_action(_action_id);
+	}
+	_action_pending = false;
+}
+
+/*
+
+Acceleration Ramps
+
+Without an acceleration limit (the default), the wheels jump straight to each
+instruction's speed. With one, run() moves them there bit by bit. Both wheels
+go through the ramp together, so arcs keep their shape.
+
+*/
+
+void DriveControl::stopWheels()
+{
+	_ramp.active = false;
+	_left_out = 0;
+	_right_out = 0;
+	executeInstruction(empty_instruction);
+	trackInstruction(empty_instruction);
+}
+
+void DriveControl::startInstruction(drive_instruction * inst)
+{
+	float left = leftOf(*inst);
+	float right = rightOf(*inst);
+	if (_accel <= 0) {
+		_left_out = left;
+		_right_out = right;
+		executeInstruction(*inst);
+		trackInstruction(*inst);
+		return;
+	}
+
+	if (isHeadingFor(left, right)) {
+		return; // The last instruction already started the ramp into this one
+	}
+
+	// Nothing eased into this one (e.g. starting from a stop), so the whole
+	// ramp happens in it. Half the ramp's time is lost, so add it back on.
+	float change = max(abs(left - _left_out), abs(right - _right_out)) * maxVelocity() / 255;
+	if (inst->duration > 0) {
+		inst->duration += rampTime(change) / 2;
+	}
+	startRamp(left, right);
+}
+
+// An S-curve (with jerk) takes a/j longer than a straight ramp, unless the
+// change is too small for the acceleration to ever build all the way up.
+float DriveControl::rampTime(float change) const
+{
+	if (_accel <= 0) {
+		return 0;
+	}
+	float time = change / _accel;
+	if (_jerk > 0) {
+		if (change >= _accel * _accel / _jerk) {
+			time += _accel / _jerk;
+		} else {
+			time = 2 * sqrt(change / _jerk);
+		}
+	}
+	return time * 1E3;
+}
+
+void DriveControl::startRamp(float left, float right)
+{
+	_ramp.left_from = _left_out;
+	_ramp.right_from = _right_out;
+	_ramp.left_to = left;
+	_ramp.right_to = right;
+	_ramp.span = max(abs(left - _left_out), abs(right - _right_out)) * maxVelocity() / 255;
+	_ramp.done = 0;
+	_ramp.accel = (_jerk > 0) ? 0 : _accel;
+	_ramp.time = millis();
+	_ramp.active = true;
+	updateRamp();
+}
+
+void DriveControl::updateRamp()
+{
+	if (!_ramp.active) {
+		return;
+	}
+
+	unsigned long now = millis();
+	float dt = (now - _ramp.time) / 1E3; // In seconds
+	_ramp.time = now;
+
+	// With a jerk limit, build the acceleration up, then ease it off in time
+	// to finish the change without a kick (but never quite stop it).
+	if (_jerk > 0) {
+		float left_over = _ramp.span - _ramp.done;
+		if (left_over <= _ramp.accel * _ramp.accel / (2 * _jerk)) {
+			_ramp.accel = max(_ramp.accel - _jerk * dt, _accel / 20);
+		} else {
+			_ramp.accel = min(_ramp.accel + _jerk * dt, _accel);
+		}
+	}
+
+	_ramp.done = min(_ramp.done + _ramp.accel * dt, _ramp.span);
+	float progress = (_ramp.span > 0) ? _ramp.done / _ramp.span : 1;
+	if (progress >= 1) {
+		_ramp.active = false;
+	}
+
+	_left_out = _ramp.left_from + (_ramp.left_to - _ramp.left_from) * progress;
+	_right_out = _ramp.right_from + (_ramp.right_to - _ramp.right_from) * progress;
+	_motors.left(int(_left_out));
+	_motors.right(int(_right_out));
+	trackSpeeds(_left_out, _right_out);
+
+	// Mixing the speeds in between (e.g. going from straight to spinning)
+	// can give odd turn rates, so mix the turn rates instead
+	float from_rate = turnRate(_ramp.left_from, _ramp.right_from);
+	_turn_rate = from_rate + (turnRate(_ramp.left_to, _ramp.right_to) - from_rate) * progress;
+}
+
+bool DriveControl::isHeadingFor(float left, float right) const
+{
+	if (_ramp.active) {
+		return _ramp.left_to == left && _ramp.right_to == right;
+	}
+	return _left_out == left && _right_out == right;
+}
+
+/*
+
+Turn Feedback
+
+A turn on the spot is timed from the spin scales, which change with the
+battery and the floor. With a heading source, run() follows the turn on the
+compass instead, slows down as it gets close and stops when it's there.
+
+*/
+
+bool DriveControl::isFeedbackTurn(const drive_instruction & inst) const
+{
+	return _turn_source != NULL && _timer_owner != this && isSpin(inst);
+}
+
+// The instruction was timed to turn the angle that was asked for, so the
+// odometry turn rate (which takes the spin scales back out) gives it back.
+void DriveControl::beginFeedbackTurn(const drive_instruction & inst)
+{
+	updateOdometry();
+	_turn = drive_turn();
+	_turn.target = turnRate(leftOf(inst), rightOf(inst)) * inst.duration;
+	_turn.odo_start = _heading;
+}
+
+// Between compass readings (and if it stops giving them, e.g. near a magnet)
+// the odometry carries on from the last one, so with no readings at all it's
+// just a timed turn. Which way the bearing goes depends on how the sensor is
+// mounted, so that's worked out from the first part of the turn.
+bool DriveControl::steerFeedbackTurn(const drive_instruction & inst, unsigned long time_passed)
+{
+	float odo = _heading - _turn.odo_start;
+	float bearing;
+	if (_turn_source(bearing)) {
+		if (!_turn.reading) {
+			_turn.reading = true;
+			_turn.anchor = odo;
+		} else {
+			_turn.seen += shortAngle(bearing - _turn.last);
+		}
+		_turn.last = bearing;
+
+		float odo_seen = odo - _turn.anchor;
+		if (_turn.sense == 0 && abs(odo_seen) >= TURN_SENSE_ANGLE && abs(_turn.seen) >= TURN_SENSE_ANGLE / 3) {
+			_turn.sense = (_turn.seen * odo_seen > 0) ? 1 : -1;
+		}
+		if (_turn.sense != 0) {
+			_turn.base = _turn.anchor + _turn.sense * _turn.seen;
+			_turn.odo_base = odo;
+		}
+	}
+
+	float turned = _turn.base + (odo - _turn.odo_base);
+	float remaining = (_turn.target >= 0) ? _turn.target - turned : turned - _turn.target;
+	if (remaining <= TURN_TOLERANCE || time_passed > 2UL * inst.duration + TURN_TIMEOUT) {
+		// The compass knows better how far it really turned
+		if (_turn.sense != 0) {
+			_heading += turned - odo;
+			_pose.heading += turned - odo;
+		}
+		return true;
+	}
+
+	// Slow down in proportion to what's left, so it doesn't overshoot
+	if (!_ramp.active) {
+		float scale = constrain(remaining / TURN_SLOW_ANGLE, TURN_MIN_SCALE, 1);
+		_left_out = leftOf(inst) * scale;
+		_right_out = rightOf(inst) * scale;
+		_motors.left(int(_left_out));
+		_motors.right(int(_right_out));
+		trackSpeeds(_left_out, _right_out);
+	}
+	return false;
+}
+
+/*
+
+Look-ahead Blending
+
+Each new instruction is checked against the ones waiting before it in the
+queue (see queueInstruction()). Moves that can be done as one are merged, and
+with a blend radius, a corner (drive, turn on the spot, drive) is rounded off
+with an arc, so the car doesn't have to stop and spin.
+
+*/
+
+void DriveControl::setBlending(float radius)
+{
+	hold();
+	_blend_radius = max(radius, 0);
+	release();
+}
+
+// Speeds are compared after taking the wheel scales back out (and rounding
+// can leave them 1 apart)
+bool DriveControl::isSpin(const drive_instruction & inst) const
+{
+	return isSpinSpeeds(leftOf(inst), rightOf(inst));
+}
+
+bool DriveControl::isSpinSpeeds(float left, float right) const
+{
+	return left * right < 0 && abs(left * _right_scalar + right * _left_scalar) <= 1;
+}
+
+bool DriveControl::isStraight(const drive_instruction & inst) const
+{
+	return inst.left_speed > 0 && inst.left_direction && inst.right_direction
+		&& abs(inst.left_speed * _right_scalar - inst.right_speed * _left_scalar) <= 1;
+}
+
+// How far (mm) the middle of the car goes, and how far (degrees) it turns,
+// in the whole of an instruction
+float DriveControl::instructionDist(const drive_instruction & inst) const
+{
+	return (leftOf(inst) + rightOf(inst)) / 2 * (maxVelocity() / 255 / 1E3) * inst.duration;
+}
+
+float DriveControl::instructionTurn(const drive_instruction & inst) const
+{
+	return turnRate(leftOf(inst), rightOf(inst)) * inst.duration;
+}
+
+// The speed scalar that would give an instruction's speeds back
+float DriveControl::instructionScalar(const drive_instruction & inst) const
+{
+	return max(inst.left_speed, inst.right_speed) / 255.0 / max(_global_speed_scalar, 1E-4);
+}
+
+// True if inst was blended into what's already queued (so it shouldn't be pushed)
+bool DriveControl::blendInstruction(const drive_instruction & inst)
+{
+	byte count = queue.count();
+	if (count == 0 || inst.duration == 0) {
+		return false;
+	}
+	drive_instruction * back = queue.at(count - 1);
+	if (back->start_time > 0 || back->duration == 0) {
+		return false; // Leave the running instruction alone
+	}
+
+	// Same speeds: just run for longer
+	if (back->left_speed == inst.left_speed && back->left_direction == inst.left_direction
+		&& back->right_speed == inst.right_speed && back->right_direction == inst.right_direction
+		&& (unsigned long) back->duration + inst.duration <= 0xFFFF) {
+		back->duration += inst.duration;
+		return true;
+	}
+
+	// Two turns on the spot: make it one turn by the total
+	if (isSpin(*back) && isSpin(inst)) {
+		float theta = instructionTurn(*back) + instructionTurn(inst);
+		float speed_scalar = instructionScalar(*back);
+		if (abs(theta) < 0.25) {
+			queue.truncate(count - 1); // They cancel out
+		} else {
+			*back = spinInstruction(theta, speed_scalar);
+		}
+		return true;
+	}
+
+	// A corner needs a free slot for what's left of inst, so with the queue
+	// full it's pushed as it is (or dropped) instead of half blended
+	if (_blend_radius <= 0 || count < 2 || queue.isFull() || !isStraight(inst) || !isSpin(*back)) {
+		return false;
+	}
+	drive_instruction * before = queue.at(count - 2);
+	if (!isStraight(*before) || (before->start_time > 0 && _ramp.active)) {
+		return false; // (If it's already ramping into the turn, it's too late)
+	}
+
+	// Round off the corner with an arc that's tangent to both straights. It
+	// cuts radius * tan(theta / 2) off the end of one and the start of the
+	// other, so the car still ends up in the same place, facing the same way.
+	float theta = instructionTurn(*back);
+	float half = abs(theta) * PI / 360;
+	if (abs(theta) > 170) {
+		return false;
+	}
+	float before_dist = instructionDist(*before);
+	if (before->start_time > 0) {
+		float elapsed = millis() - before->start_time;
+		before_dist *= 1 - elapsed / before->duration;
+	}
+	float after_dist = instructionDist(inst);
+	float radius = min(_blend_radius, min(before_dist, after_dist) / 2 / tan(half));
+	if (radius < _track / 2) {
+		return false; // Too tight (the inside wheel would have to go backwards)
+	}
+	float cut = radius * tan(half);
+
+	// theta is in the pose's sense (like the spin's), and arcInstruction()
+	// turns it back into wheels, so the arc turns the same way the spin did.
+	// With ramps, each piece eases in over the last half ramp of the one
+	// before and out over the first half of the one after, so each has to
+	// last a whole ramp, or the turn comes out short (or long).
+	drive_instruction arc = arcInstruction(radius, theta, instructionScalar(inst));
+	if (_accel > 0) {
+		float change = max(max(abs(leftOf(arc) - leftOf(*before)), abs(rightOf(arc) - rightOf(*before))),
+			max(abs(leftOf(arc) - leftOf(inst)), abs(rightOf(arc) - rightOf(inst))));
+		float ramp = rampTime(change * maxVelocity() / 255);
+		float before_time = (before_dist - cut) * before->duration / instructionDist(*before);
+		float after_time = (after_dist - cut) * inst.duration / after_dist;
+		if (arc.duration < ramp || before_time < ramp || after_time < ramp) {
+			return false;
+		}
+	}
+
+	before->duration -= before->duration * cut / instructionDist(*before);
+	*back = arc;
+	queue.push(newInstruction(after_dist - cut, after_dist - cut, instructionScalar(inst))); // There's room (checked above)
+	return true;
+}
+
+/*
+
+Waypoint Following
+
+Pure pursuit: every run(), find the point on the path that's a lookahead
+distance away from the car, and set the wheels to drive the arc through it.
+The speeds come straight from the pose (there are no instructions), so the
+car follows the whole path in one motion, and points can keep being added.
+
+*/
+
+bool DriveControl::addWaypoint(float x, float y)
+{
+	drive_waypoint point;
+	point.x = x;
+	point.y = y;
+	hold();
+	bool added = _waypoints.push(point);
+	release();
+	return added;
+}
+
+void DriveControl::followWaypoints(float speed_scalar)
+{
+	hold();
+	_pursuit_speed = constrain(speed_scalar, 0, 1);
+	_pursuing = true;
+	_pursuit_started = false;
+	release();
+}
+
+void DriveControl::clearWaypoints()
+{
+	hold();
+	_waypoints.clear();
+	release();
+}
+
+byte DriveControl::getWaypointRoom() const
+{
+	return DRIVE_WAYPOINTS - _waypoints.count();
+}
+
+bool DriveControl::isFollowing() const
+{
+	return _pursuing;
+}
+
+void DriveControl::setLookahead(float dist)
+{
+	hold();
+	_lookahead = max(dist, PURSUIT_ARRIVE);
+	release();
+}
+
+// How far (mm) it is from (x, y) to a waypoint
+static float distanceTo(const drive_waypoint & point, float x, float y)
+{
+	return sqrt(sq(point.x - x) + sq(point.y - y));
+}
+
+void DriveControl::steerPursuit()
+{
+	// The first segment starts wherever the car is when the queue runs out
+	if (!_pursuit_started) {
+		_pursuit_started = true;
+		_pursuit_from.x = _pose.x;
+		_pursuit_from.y = _pose.y;
+		_pursuit_time = millis();
+		_ramp.active = false; // Speed changes are limited here instead
+	}
+	_driving = true;
+
+	// Move on to the next segment once this one's end is inside the lookahead
+	drive_waypoint * to = _waypoints.peek();
+	while (to != NULL && _waypoints.count() > 1 && distanceTo(*to, _pose.x, _pose.y) < _lookahead) {
+		_pursuit_from = *to;
+		_waypoints.drop();
+		to = _waypoints.peek();
+	}
+	if (to == NULL) {
+		finishPursuit();
+		return;
+	}
+
+	// Stop at the last waypoint once we're there (or going past it)
+	float rad = _pose.heading * PI / 180;
+	float dist = distanceTo(*to, _pose.x, _pose.y);
+	float ahead = (to->x - _pose.x) * sin(rad) + (to->y - _pose.y) * cos(rad);
+	if (_waypoints.count() == 1 && (dist < PURSUIT_ARRIVE || (dist < _lookahead && ahead <= 0))) {
+		_waypoints.drop();
+		finishPursuit();
+		return;
+	}
+
+	// Aim for the far place where the lookahead circle crosses the segment.
+	// If it doesn't (the car's wandered off), head straight for the end.
+	float goal_x = to->x;
+	float goal_y = to->y;
+	float seg_x = to->x - _pursuit_from.x;
+	float seg_y = to->y - _pursuit_from.y;
+	float off_x = _pursuit_from.x - _pose.x;
+	float off_y = _pursuit_from.y - _pose.y;
+	float a = sq(seg_x) + sq(seg_y);
+	float b = 2 * (off_x * seg_x + off_y * seg_y);
+	float c = sq(off_x) + sq(off_y) - sq(_lookahead);
+	float disc = b * b - 4 * a * c;
+	if (a > 0 && disc >= 0) {
+		float t = (-b + sqrt(disc)) / (2 * a);
+		if (t >= 0 && t <= 1) {
+			goal_x = _pursuit_from.x + t * seg_x;
+			goal_y = _pursuit_from.y + t * seg_y;
+		}
+	}
+
+	// Curvature (1/radius, right is positive) of the arc through the goal.
+	// Any tighter than pivoting on one wheel and the spin scales come in.
+	float goal_dx = goal_x - _pose.x;
+	float goal_dy = goal_y - _pose.y;
+	float side = goal_dx * cos(rad) - goal_dy * sin(rad);
+	float goal_sq = sq(goal_dx) + sq(goal_dy);
+	float curve = (goal_sq > 0) ? 2 * side / goal_sq : 0;
+	curve = constrain(curve, -2 / _track, 2 / _track);
+
+	// Full speed on the outside wheel, but slow enough to stop by the last
+	// waypoint (that's been added so far)
+	float max_velocity = maxVelocity();
+	float speed = _pursuit_speed * _global_speed_scalar * max_velocity;
+	if (_accel > 0) {
+		float left_to_go = dist;
+		for (byte i = 1; i < _waypoints.count(); ++i) {
+			left_to_go += distanceTo(*_waypoints.at(i), _waypoints.at(i - 1)->x, _waypoints.at(i - 1)->y);
+		}
+		speed = min(speed, sqrt(2 * _accel * left_to_go));
+	}
+	float outside = 1 + abs(curve) * _track / 2;
+	float inside = 1 - abs(curve) * _track / 2;
+	float left = (curve * _turn_sense >= 0) ? 1 : inside / outside;
+	float right = (curve * _turn_sense >= 0) ? inside / outside : 1;
+	left *= speed * _left_scalar * 255 / max_velocity;
+	right *= speed * _right_scalar * 255 / max_velocity;
+
+	// No ramps here (the target moves every time), so just limit how much
+	// the speeds can change since last time
+	unsigned long now = millis();
+	float step = (_accel > 0) ? _accel * (now - _pursuit_time) / 1E3 * 255 / max_velocity : 510;
+	_pursuit_time = now;
+	_left_out += constrain(left - _left_out, -step, step);
+	_right_out += constrain(right - _right_out, -step, step);
+	_motors.left(int(_left_out));
+	_motors.right(int(_right_out));
+	trackSpeeds(_left_out, _right_out);
+}
+
+// Leaves _driving set, so run() stops the car as usual once it's slowed down
+void DriveControl::finishPursuit()
+{
+	_pursuing = false;
+	if (_accel > 0) {
+		startRamp(0, 0);
+	} else {
+		stopWheels();
+	}
+}
+
+#if defined(__AVR__)
+// Interrupts are let back in straight away, so the sonar (timer 2) and servo
+// (timer 1) interrupts still happen on time while run() does its sums.
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK){
+	DriveControl::handleTimer();
+}
+#endif
@@ -18,15 +18,16 @@ Other advanced features of the API include:
 	* Moving to a specific point relative to vehicle's current position
 	* Fine position adjustment (in all directions)
 	* Moving forwards and backwards (user specifies)
+	* Driving arcs, and smooth paths made of them
 
 See the README for examples and a detailed reference.
 
-Important Note: This class does not keep track of where the car has been. Its
-only job is to get it where you want it to go - the user will need to write
-the code to record where the car has been (if desired). Additionally, if you
-want the car to follow a path, then you will need to combine the "goToPoint()"
-and "isDriving()" methods yourself. This is because the format of your path
-may not be conducive to a pre-written method.
+Important Note: This class only keeps a rough idea of where the car is (the
+pose, from how fast the wheels were told to go). It gets less sure the further
+it goes, so correct it with the sensors when you can (correctX(), correctY()
+and correctHeading()). To follow a path, give it waypoints on the same map
+(see "addWaypoint()" and "followWaypoints()"), and it will steer through them
+in one smooth motion.
 
 Author: Jason Storey
 License: GPLv3
@@ -46,13 +47,56 @@ License: GPLv3
 #endif
 
 #include <L293dDriver.h>
-#include <QueueList.h>
+#include <RingQueue.h>
 #include <Coordinates.h>
 #include <ARDVARC_UTIL.h>
 
-#define L_SPIN_SCALE -1.9 // How much extra / less the spin needs to be for correct turning
-#define R_SPIN_SCALE -0.8 // How much extra / less the spin needs to be for correct turning
-#define NR_SCALE	1.3 // How much extra to turn right wheel when nudging (helps balance to keep straight)
+#define L_SPIN_SCALE -1.9 // How much extra / less the spin needs to be for correct turning (default, see setSpinScales)
+#define R_SPIN_SCALE -0.8 // How much extra / less the spin needs to be for correct turning (default, see setSpinScales)
+#define NR_SCALE	1.3 // How much extra to turn right wheel when nudging (helps balance to keep straight) (default, see setNudgeScale)
+#define DRIVE_CAL_VERSION 1 // Bump this if drive_calibration changes, so old EEPROM data is ignored
+#define DRIVE_QUEUE_SIZE 12 // Most instructions that can be waiting in the queue at once
+#define DRIVE_LOOKAHEAD 3 // How many script steps are queued at once (3 is enough to blend a corner)
+#define DRIVE_TICK 5 // ms between runs when the timer interrupt is driving (see beginTimer)
+#define DRIVE_WAYPOINTS 8 // Most waypoints that can be waiting at once
+#define PURSUIT_LOOKAHEAD 150 // How far ahead (mm) along the path the waypoint follower aims
+#define PURSUIT_ARRIVE 20 // Close enough (mm) to the last waypoint to stop
+#define TURN_SLOW_ANGLE 30 // With turn feedback, start slowing down this many degrees from the end
+#define TURN_MIN_SCALE 0.3 // Slowest (as a fraction of the turn's speed) it gets near the end
+#define TURN_TOLERANCE 1 // Close enough (degrees) to call the turn finished
+#define TURN_SENSE_ANGLE 15 // Degrees to turn before working out which way the compass goes
+#define TURN_TIMEOUT 1000 // Extra ms (on top of twice the timed turn) before giving up on a turn
+#define POSE_DIST_NOISE 1 // Variance (mm^2) added along the way for each mm driven
+#define POSE_TURN_NOISE 1 // Variance (degrees^2) added to the heading for each degree turned
+#define POSE_DRIFT_NOISE 0.01 // Variance (degrees^2) added to the heading for each mm driven
+
+/*
+
+Drive scripts are fixed routines kept in flash (PROGMEM), made by listing the
+steps below. runScript() works through a few steps at a time, so a script only
+ever takes up DRIVE_LOOKAHEAD places in the queue. Distances are in mm, angles in
+degrees (right is positive), times in ms and speeds in percent. Steps are 2-5
+bytes each, and the list must finish with DRIVE_END. See the README.
+
+*/
+
+#define DRIVE_OP_END	0
+#define DRIVE_OP_FORWARD	1
+#define DRIVE_OP_TURN	2
+#define DRIVE_OP_ARC	3
+#define DRIVE_OP_PAUSE	4
+#define DRIVE_OP_SPEED	5
+#define DRIVE_OP_ACTION	6
+
+#define DRIVE_INT(v) byte((v) & 0xFF), byte(((v) >> 8) & 0xFF) // Two bytes, low first (-32768 to 32767)
+#define DRIVE_FORWARD(mm) DRIVE_OP_FORWARD, DRIVE_INT(mm)
+#define DRIVE_BACKWARD(mm) DRIVE_OP_FORWARD, DRIVE_INT(-(mm))
+#define DRIVE_TURN(deg) DRIVE_OP_TURN, DRIVE_INT(deg) // On the spot
+#define DRIVE_ARC(radius, deg) DRIVE_OP_ARC, DRIVE_INT(radius), DRIVE_INT(deg) // Forwards around a circle
+#define DRIVE_PAUSE(ms) DRIVE_OP_PAUSE, DRIVE_INT(ms)
+#define DRIVE_SPEED(percent) DRIVE_OP_SPEED, byte(percent) // Speed scalar for the steps after it
+#define DRIVE_ACTION(id) DRIVE_OP_ACTION, byte(id) // Waits for the car to stop, then calls the action function
+#define DRIVE_END DRIVE_OP_END
 
 /*
 
@@ -60,7 +104,8 @@ This is "Sir DriveControl". His job is to make the motors turn in such a precise
 manner that the car ends up where you want it to. All you have to do is say
 where and how fast!
 
-Don't forget to call the "run()" function!
+Don't forget to call the "run()" function! (Or let a timer interrupt call it
+for you, with "beginTimer()".)
 
 See the README for specific details and examples.
 
@@ -75,6 +120,59 @@ struct drive_instruction {
 	bool right_direction = 1;
 };
 
+// A smooth change from one pair of wheel speeds to another (see setAcceleration)
+struct drive_ramp {
+	bool active = false;
+	float left_from = 0; // Wheel speeds (-255 to 255) at the start of the ramp
+	float right_from = 0;
+	float left_to = 0; // Wheel speeds to finish on
+	float right_to = 0;
+	float span = 0; // How much (mm/s) the wheel changing the most has to change
+	float done = 0; // How much (mm/s) of the span it's been through so far
+	float accel = 0; // Acceleration (mm/s/s) right now (it builds up when jerk is limited)
+	unsigned long time = 0; // When (ms) the ramp was last brought up to date
+};
+
+// Progress through a turn on the spot with heading feedback (see setTurnFeedback)
+struct drive_turn {
+	float target = 0; // Degrees to turn (right is positive)
+	float odo_start = 0; // Odometry heading when the turn started
+	float base = 0; // Degrees turned, as of the last compass reading
+	float odo_base = 0; // Odometry (degrees turned) at that reading
+	float anchor = 0; // Odometry at the first compass reading
+	float seen = 0; // Degrees the compass has moved since its first reading
+	float last = 0; // Last compass bearing
+	bool reading = false; // If the compass has given a reading yet
+	char sense = 0; // 1 if the bearing goes up turning right, -1 if down, 0 if we don't know yet
+};
+
+// The hand-tuned constants, all together so they can be measured (see the
+// DriveCalibration library) and kept in EEPROM
+struct drive_calibration {
+	float rpdc = 1; // See setRevsPerDC
+	float left_scale = 1; // See setWheelScales
+	float right_scale = 1;
+	float back_scale = 1; // See setBackScaling
+	float left_spin = L_SPIN_SCALE; // See setSpinScales
+	float right_spin = R_SPIN_SCALE;
+	float nudge_scale = NR_SCALE; // See setNudgeScale
+};
+
+// A point to drive through (on the same map as the pose, in mm)
+struct drive_waypoint {
+	float x = 0;
+	float y = 0;
+};
+
+// Where the car is, and how sure we are of it. x is to the right and y is
+// forwards (from where it started, or setPose), and the heading is in degrees
+// to the right of the y axis. cov is the covariance of (x, y, heading).
+struct drive_pose {
+	float x = 0;
+	float y = 0;
+	float heading = 0;
+	float cov[3][3] = {};
+};
 
 class DriveControl
 {
@@ -88,10 +186,26 @@ public:
 	void setBackScaling(float speed); // How to modify drive duration for moving backwards (scalar for duration)
 	void setWheelScales(float left, float right); // One of these should be 1, and the other is the percent rotation
 	void setMotorPins(int en1, int in1, int in2, int en2, int in3, int in4); // Pins for the motors
+	void setAcceleration(float accel); // Fastest the wheels can speed up or slow down (mm/s/s). 0 (default) is instantly
+	void setJerk(float jerk); // Fastest the acceleration can build up (mm/s/s/s). 0 (default) is instantly
+	void setSpinScales(float left, float right); // Extra / less wheel distance for turning on the spot (see L_SPIN_SCALE)
+	void setNudgeScale(float scale); // Extra right wheel distance when nudging (see NR_SCALE)
+	float getTrackWidth() const;
+	short getTurnSense() const; // 1, or -1 if turns go the other way (negative spin scales, see setSpinScales)
+
+	// Calibration (see the DriveCalibration library). Set the hand-tuned values first, then load over them.
+	drive_calibration getCalibration() const; // The constants being used right now
+	void setCalibration(const drive_calibration & cal); // Use these constants
+	bool loadCalibration(); // Loads the constants from EEPROM. False (and nothing changes) if there aren't any.
+	void saveCalibration(); // Saves the constants being used to EEPROM
 
 	void run(); // This class runs on a queue system. This function must be called to progress the queue. See README.
 	void clearQueue(); // Remove all instructions from queue, finish up what we're doing.
 	void stopAll(); // Clears the queue and executes an instruction to stop all motors.
+	bool beginTimer(); // Runs the queue from a timer interrupt (every DRIVE_TICK ms), so run() isn't needed
+	void endTimer(); // Back to calling run() by hand
+	bool isTimerRunning() const;
+	static void handleTimer(); // Called from the timer interrupt
 
 	void forward(float dist, float speed_scalar = 1); // Moves forwards a certain `dist` (in mm). Optional speed scalar.
 	void backward(float dist, float speed_scalar = 1); // Moves backwards a certain `dist` (in mm).
@@ -100,6 +214,19 @@ public:
 	void goToPointSticky(float x, float y, float speed_scalar = 1); // As above, but don't undo last rotation
 	void nudge(float x, float y, float speed_scalar = 1); // Uses fine adjustment techniques to move a small distance
 
+	// Arcs. Positive angles go to the right, and the car always goes forwards.
+	void driveArc(float radius, float theta, float speed_scalar = 1); // Drives theta degrees around a circle (radius in mm), in one instruction
+	float arcToPoint(float x, float y, float speed_scalar = 1); // One smooth arc to a relative point (in mm). Returns the degrees it turns.
+	void followPath(const float points[][2], byte count, float speed_scalar = 1); // Arcs through each point (in mm, relative to the start) in turn
+
+	// Waypoint following (pure pursuit). Points are on the pose's map, and can be added while it drives.
+	bool addWaypoint(float x, float y); // Adds a point to drive through. False if there's no room (see DRIVE_WAYPOINTS).
+	void followWaypoints(float speed_scalar = 1); // Steers through the waypoints (after anything queued), stopping at the last
+	void clearWaypoints(); // Forgets the waypoints, so the car stops
+	byte getWaypointRoom() const; // How many more waypoints can be added right now
+	bool isFollowing() const; // True until the last waypoint is reached
+	void setLookahead(float dist); // How far ahead (mm) to aim. Longer is smoother, shorter cuts fewer corners.
+
 	// All angles are in degrees (because people are used to it!)
 	void turnRight(float theta, float speed_scalar = 1); // Shortcut for turnAngle(|theta|). Can be as large as needed, must be > 0.
 	void turnLeft(float theta, float speed_scalar = 1); // Shortcut for turnAngle(-|theta|). Can be as large as needed, must be > 0.
@@ -109,7 +236,28 @@ public:
 	
 	void pause(int duration); // Make the driver stop the wheels for <duration> ms.
 
+	void runScript(const byte * script); // Drive through a script in PROGMEM (replaces any script that's running)
+	void setScriptAction(void (*action)(byte id)); // Function to call for DRIVE_ACTION steps (e.g. to move the arm)
+	bool isScriptRunning() const; // True until the last step of the script has been queued
+
+	void setTurnFeedback(bool (*source)(float & heading)); // Finish turns on the spot by a compass (NULL for timed turns)
+	void setBlending(float radius); // Round off drive-turn-drive corners with arcs up to this radius (mm). 0 is off.
+
 	bool isDriving() const; // Returns the "_driving" flag, for external use. Will be true when items are in queue.
+	float getDistanceTravelled(); // Estimated distance (mm) driven forwards (minus backwards) since start or reset
+	void resetDistanceTravelled(); // Sets the travelled distance back to 0
+	float getHeading(); // Estimated angle (degrees, right is positive) turned since start or reset. Not wrapped.
+	void resetHeading(); // Sets the heading back to 0
+
+	// Pose (dead reckoning). Follows the car on a map, unlike getHeading().
+	const drive_pose & getPose(); // Brings the pose up to date and returns it (no copy)
+	float getX(); // Estimated position (mm) to the right of the start
+	float getY(); // Estimated position (mm) forwards of the start
+	void setPose(float x, float y, float heading); // Say where the car is for sure (clears the uncertainty)
+	void setPoseNoise(float dist, float turn, float drift); // How fast the uncertainty grows (see the POSE_ defines)
+	void correctX(float x, float variance); // Blend in a measured x (e.g. from a sonar to a known wall)
+	void correctY(float y, float variance); // As above, for y
+	void correctHeading(float heading, float variance); // Blend in a measured heading (e.g. from the compass)
 private:
 	L293D _motors; // Default initializer works fine.
 	bool _driving = false; // Flag for if driving or not. Could be used externally to perform an interrupt routine.
@@ -120,17 +268,94 @@ private:
 	float _wheel_dia = 1; // Wheel diameter - for distance tracking while travelling
 	float _track = 1; // Distance between wheel centers - used for rotational calculations
 	float _rpdc = 1; // Revs-per-Duty-cycle. Note that this is actually RPM per Duty Cycle.
+	float _accel = 0; // Acceleration limit (mm/s/s) for the wheels. 0 means no ramps.
+	float _jerk = 0; // Jerk limit (mm/s/s/s). 0 means the acceleration changes instantly.
+	float _left_spin = abs(L_SPIN_SCALE); // Scales a left turn on the spot
+	float _right_spin = abs(R_SPIN_SCALE); // Scales a right turn on the spot
+	short _turn_sense = (L_SPIN_SCALE + R_SPIN_SCALE < 0) ? -1 : 1; // -1 if the wheels turn the car the other way (from the spin scales' sign)
+	float _nudge_scale = NR_SCALE; // Scales the right wheel when nudging
 
 	unsigned long time_passed; // Declaration for keeping track of time
 
-	QueueList<drive_instruction> queue; // Dynamic linked list to hold drive instructions
+	// Odometry (estimated from the speeds we've told the wheels to go)
+	float _travelled = 0; // Distance (mm) the middle of the car has moved along its heading
+	float _left_vel = 0; // Speed (mm/ms) of the left wheel right now. Negative is backwards.
+	float _right_vel = 0; // As above, for the right wheel
+	float _heading = 0; // Angle (degrees) turned to the right
+	float _turn_rate = 0; // How fast (degrees/ms) we're turning right now
+	unsigned long _odo_time = 0; // Time value in ms when _travelled was last brought up to date
+	drive_pose _pose; // Dead reckoned position, heading and covariance
+	float _dist_noise = POSE_DIST_NOISE;
+	float _turn_noise = POSE_TURN_NOISE;
+	float _drift_noise = POSE_DRIFT_NOISE;
+
+	RingQueue<drive_instruction, DRIVE_QUEUE_SIZE> queue; // Fixed size ring buffer to hold drive instructions (no heap)
 	drive_instruction empty_instruction; // Used in value checking and to stop the car
+	drive_ramp _ramp; // The speed change that's happening now (if any)
+	float _left_out = 0; // Speed (-255 to 255) the left wheel is being driven at right now
+	float _right_out = 0; // As above, for the right wheel
+
+	const byte * _script = NULL; // Next step of the running script (in PROGMEM), NULL if there isn't one
+	float _script_speed = 1; // Speed scalar set by DRIVE_SPEED
+	void (*_script_action)(byte id) = NULL; // Called by DRIVE_ACTION
+	mutable volatile bool _action_pending = false; // A DRIVE_ACTION reached on the timer, waiting to be called outside the interrupt
+	byte _action_id = 0; // Its id
+
+	bool (*_turn_source)(float & heading) = NULL; // Heading feedback for turns (NULL means timed turns)
+	drive_turn _turn; // The turn that's running (with feedback)
+	float _blend_radius = 0; // Biggest arc (mm) to round corners off with (0 is off)
+
+	RingQueue<drive_waypoint, DRIVE_WAYPOINTS> _waypoints; // Still to come (the front one is being driven towards)
+	drive_waypoint _pursuit_from; // Start of the path segment being followed
+	bool _pursuing = false; // Set by followWaypoints() until the last waypoint
+	bool _pursuit_started = false; // If the queue's finished and the pursuit has taken over the wheels
+	float _pursuit_speed = 1; // Speed scalar for following
+	float _lookahead = PURSUIT_LOOKAHEAD;
+	unsigned long _pursuit_time = 0; // When (ms) the wheel speeds were last set
+
+	static DriveControl * _timer_owner; // Instance run by the timer interrupt
+	volatile byte _hold = 0; // While this isn't 0, the timer interrupt leaves everything alone
+	byte _ticks = 0; // Timer interrupts since the last run
+	bool _in_timer = false; // True while run() is being called from the interrupt
 
+	void hold(); // Keeps the timer interrupt out (calls can nest)
+	void release(); // Lets it back in once every hold() has been released
+	bool canPrint() const; // Debug messages are on (and we're not in the interrupt)
 	bool boolsgn(float num); // Return true if positive or 0, false if negative
 	short sgnbool(bool boolsgn); // Return 1 if true, or -1 if false
 	drive_instruction newInstruction(float left_dist, float right_dist, float speed_scalar = 1); // Create and return instruction
 	void addInstruction(float left_dist, float right_dist, float speed_scalar = 1);
+	void queueInstruction(const drive_instruction & inst); // Pushes onto the queue (warns if it's full)
+	bool blendInstruction(const drive_instruction & inst); // Merges it into what's queued, if it can. See setBlending.
+	drive_instruction spinInstruction(float theta, float speed_scalar); // The instruction for turnAngle()
+	drive_instruction arcInstruction(float radius, float theta, float speed_scalar); // The instruction for driveArc()
+	bool isSpin(const drive_instruction & inst) const; // Turning on the spot
+	bool isSpinSpeeds(float left, float right) const; // As above, for wheel speeds from -255 to 255 (opposite, in the wheel scales' ratio)
+	bool isStraight(const drive_instruction & inst) const; // Driving straight forwards
+	float instructionDist(const drive_instruction & inst) const; // How far (mm) it goes
+	float instructionTurn(const drive_instruction & inst) const; // How far (degrees) it turns
+	float instructionScalar(const drive_instruction & inst) const; // The speed scalar it was made with
 	void executeInstruction(drive_instruction instruction) const; // Actually run the instruction
+	float maxVelocity() const; // The fastest a wheel can go (in mm/s)
+	void updateOdometry(); // Adds the distance covered since the last update to _travelled
+	void advancePose(float dist, float turn); // Moves the pose (and grows the covariance) by a small step
+	void correctPose(byte i, float innovation, float variance); // Kalman update of one part of the pose
+	void trackInstruction(const drive_instruction & inst); // Starts tracking the wheel speeds of an instruction
+	void trackSpeeds(float left, float right); // As above, for wheel speeds from -255 to 255
+	float turnRate(float left, float right) const; // Degrees/ms the car turns at with these wheel speeds
+	void stopWheels(); // Stops the motors straight away (no ramp)
+	void startInstruction(drive_instruction * inst); // Executes an instruction, or ramps into it
+	float rampTime(float change) const; // How long (ms) it takes to change speed by `change` (mm/s)
+	void startRamp(float left, float right); // Starts ramping from the current wheel speeds to these
+	void updateRamp(); // Moves the wheels further along the ramp
+	bool isHeadingFor(float left, float right) const; // If the wheels are at (or ramping to) these speeds
+	bool isFeedbackTurn(const drive_instruction & inst) const; // If it's a turn on the spot that uses the feedback
+	void beginFeedbackTurn(const drive_instruction & inst); // Works out how far it's meant to turn
+	bool steerFeedbackTurn(const drive_instruction & inst, unsigned long time_passed); // True once it's there
+	void loadScript(); // Queues script steps until there's one waiting behind the running instruction
+	void runPendingAction() const; // Calls an action the timer left for the sketch (if there is one)
+	void steerPursuit(); // Sets the wheel speeds towards the next waypoint
+	void finishPursuit(); // Stops at the last waypoint
 };
 
 #endif
\ No newline at end of file
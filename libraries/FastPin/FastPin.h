@@ -0,0 +1,108 @@
+/* 
+
+Compile-time pins for the ATmega328P (Arduino UNO). digitalWrite() and friends
+look up the port and bit of a pin in a table every time they're called (and
+check for PWM timers to turn off). When the pin number is known when compiling,
+all of that can be worked out by the compiler instead, and a write becomes a
+single instruction.
+
+	FastPin<13>::output();
+	FastPin<13>::high(); // Same as digitalWrite(13, HIGH), see tests/pin_bench for how much quicker
+
+Only pins 0-19 (D0-D13 and A0-A5) are known. See the README.
+
+License: GPLv3
+
+*/
+
+#ifndef fastpin_h
+#define fastpin_h
+
+// Pull in the Arduino standard libraries
+#if ARDUINO >= 100
+  #include "Arduino.h"
+#else
+  #include "WProgram.h"
+  #include "pins_arduino.h"
+  #include "WConstants.h"
+#endif
+
+#define FAST_PORT_D 0 // Pins 0-7
+#define FAST_PORT_B 1 // Pins 8-13
+#define FAST_PORT_C 2 // Pins 14-19 (A0-A5)
+
+/*
+
+Everything is static, so there's nothing to construct. Each function is
+inlined, and with the pin fixed, the port and bit are constants (so a write
+turns into a single sbi or cbi instruction).
+
+*/
+template <byte PIN>
+struct FastPin
+{
+	static_assert(PIN < 20, "FastPin only knows the UNO's pins (0-19)");
+
+	static const byte port_id = (PIN < 8) ? FAST_PORT_D : ((PIN < 14) ? FAST_PORT_B : FAST_PORT_C);
+	static const byte mask = _BV((PIN < 8) ? PIN : ((PIN < 14) ? PIN - 8 : PIN - 14));
+
+	static volatile uint8_t & port() { return (PIN < 8) ? PORTD : ((PIN < 14) ? PORTB : PORTC); }
+	static volatile uint8_t & ddr() { return (PIN < 8) ? DDRD : ((PIN < 14) ? DDRB : DDRC); }
+	static volatile uint8_t & in() { return (PIN < 8) ? PIND : ((PIN < 14) ? PINB : PINC); }
+
+	static void output() { ddr() |= mask; }
+	static void input() { ddr() &= ~mask; }
+	static void high() { port() |= mask; }
+	static void low() { port() &= ~mask; }
+	static void write(bool value) { if (value) high(); else low(); }
+	static bool read() { return in() & mask; }
+
+	// Same as analogWrite() (0 and 255 are plain low and high), for the PWM
+	// pins (3, 5, 6, 9, 10, 11). Any other pin falls back to analogWrite().
+	static void pwm(byte value) {
+		if (value == 0 || value == 255) {
+			pwmConnect(false);
+			write(value);
+			return;
+		}
+		switch (PIN) {
+			case 3: OCR2B = value; break;
+			case 5: OCR0B = value; break;
+			case 6: OCR0A = value; break;
+			case 9: OCR1A = value; break;
+			case 10: OCR1B = value; break;
+			case 11: OCR2A = value; break;
+			default: analogWrite(PIN, value); return;
+		}
+		pwmConnect(true);
+	}
+
+	// Hands the pin over to its timer (or takes it back)
+	static void pwmConnect(bool on) {
+		switch (PIN) {
+			case 3: if (on) TCCR2A |= _BV(COM2B1); else TCCR2A &= ~_BV(COM2B1); break;
+			case 5: if (on) TCCR0A |= _BV(COM0B1); else TCCR0A &= ~_BV(COM0B1); break;
+			case 6: if (on) TCCR0A |= _BV(COM0A1); else TCCR0A &= ~_BV(COM0A1); break;
+			case 9: if (on) TCCR1A |= _BV(COM1A1); else TCCR1A &= ~_BV(COM1A1); break;
+			case 10: if (on) TCCR1A |= _BV(COM1B1); else TCCR1A &= ~_BV(COM1B1); break;
+			case 11: if (on) TCCR2A |= _BV(COM2A1); else TCCR2A &= ~_BV(COM2A1); break;
+		}
+	}
+};
+
+/*
+
+Changes several pins on the same port in one go. Writing a 1 to a bit of the
+PIN register flips that pin, so only the pins in `mask` are touched, and they
+all change in the same instruction. An interrupt that changes a different pin
+on the port in the middle can't be undone by it (unlike PORTD = ...).
+
+*/
+template <byte PORT_ID>
+inline void fastPortWrite(byte mask, byte bits) {
+	volatile uint8_t & port = (PORT_ID == FAST_PORT_D) ? PORTD : ((PORT_ID == FAST_PORT_B) ? PORTB : PORTC);
+	volatile uint8_t & in = (PORT_ID == FAST_PORT_D) ? PIND : ((PORT_ID == FAST_PORT_B) ? PINB : PINC);
+	in = (port ^ bits) & mask;
+}
+
+#endif
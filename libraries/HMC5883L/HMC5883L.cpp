@@ -67,6 +67,41 @@ Vector HMC5883L::readNormalize(void)
     return v;
 }
 
+// Same as readRaw(), but all six output registers come in one I2C transaction
+Vector HMC5883L::readRawBurst(void)
+{
+    int16_t x, y, z;
+
+    if (readBurst(x, y, z))
+    {
+	v.XAxis = x - xOffset;
+	v.YAxis = y - yOffset;
+	v.ZAxis = z;
+    }
+
+    return v;
+}
+
+// Same as readNormalize(), but all six output registers come in one I2C transaction
+Vector HMC5883L::readNormalizeBurst(void)
+{
+    int16_t x, y, z;
+
+    if (readBurst(x, y, z))
+    {
+	v.XAxis = ((float)x - xOffset) * mgPerDigit;
+	v.YAxis = ((float)y - yOffset) * mgPerDigit;
+	v.ZAxis = (float)z * mgPerDigit;
+    }
+
+    return v;
+}
+
+float HMC5883L::getMgPerDigit(void)
+{
+    return mgPerDigit;
+}
+
 void HMC5883L::setOffset(int xo, int yo)
 {
     xOffset = xo;
@@ -275,4 +310,43 @@ int16_t HMC5883L::readRegister16(uint8_t reg)
     value = vha << 8 | vla;
 
     return value;
-}
\ No newline at end of file
+}
+
+// Read all six output registers (X, Z, Y order on the chip) in one go.
+// The register pointer auto-increments, and the chip holds the outputs
+// until all six have been read, so the three axes always belong together.
+bool HMC5883L::readBurst(int16_t &x, int16_t &y, int16_t &z)
+{
+    uint8_t buffer[6];
+
+    Wire.beginTransmission(HMC5883L_ADDRESS);
+    #if ARDUINO >= 100
+        Wire.write(HMC5883L_REG_OUT_X_M);
+    #else
+        Wire.send(HMC5883L_REG_OUT_X_M);
+    #endif
+    if (Wire.endTransmission() != 0)
+    {
+	return false;
+    }
+
+    if (Wire.requestFrom(HMC5883L_ADDRESS, 6) != 6)
+    {
+	return false;
+    }
+
+    for (uint8_t i = 0; i < 6; ++i)
+    {
+    #if ARDUINO >= 100
+	buffer[i] = Wire.read();
+    #else
+	buffer[i] = Wire.receive();
+    #endif
+    }
+
+    x = buffer[0] << 8 | buffer[1];
+    z = buffer[2] << 8 | buffer[3];
+    y = buffer[4] << 8 | buffer[5];
+
+    return true;
+}
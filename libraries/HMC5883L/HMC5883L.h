@@ -98,6 +98,10 @@ class HMC5883L
 
 	Vector readRaw(void);
 	Vector readNormalize(void);
+	Vector readRawBurst(void);
+	Vector readNormalizeBurst(void);
+	bool readBurst(int16_t &x, int16_t &y, int16_t &z);
+	float getMgPerDigit(void);
 
 	void  setOffset(int xo, int yo);
 
@@ -24,6 +24,8 @@ License: GPLv3
   #include "WConstants.h"
 #endif
 
+#include <FastPin.h>
+
 #define INVERTER true  // Reverse motor directions to keep constant.
 
 /*
@@ -75,5 +77,58 @@ private:
 	Motor _right_motor;
 };
 
+/*
+
+Same as L293D, but with the pins fixed when compiling (as template
+parameters), so every command is a few register writes instead of table
+lookups (see FastPin). All four direction pins have to be on the same port,
+and they're all changed in one write, so the two motors never disagree for a
+moment. Speeds are whole numbers (-255 to 255), like the duty cycle itself.
+
+	FastL293D<3, 4, 2, 5, 6, 7> motors;
+	motors.begin();
+	motors.drive(200, -200); // Spin
+
+*/
+template <byte EN1, byte IN1, byte IN2, byte EN2, byte IN3, byte IN4>
+class FastL293D
+{
+public:
+	static_assert(FastPin<IN1>::port_id == FastPin<IN2>::port_id &&
+		FastPin<IN1>::port_id == FastPin<IN3>::port_id &&
+		FastPin<IN1>::port_id == FastPin<IN4>::port_id,
+		"FastL293D needs all the direction pins on one port");
+
+	void begin() {
+		FastPin<EN1>::output(); FastPin<IN1>::output(); FastPin<IN2>::output();
+		FastPin<EN2>::output(); FastPin<IN3>::output(); FastPin<IN4>::output();
+	}
+	void left(int speed) { drive(speed, _right); }
+	void right(int speed) { drive(_left, speed); }
+
+	// Sets both motors at once
+	void drive(int left, int right) {
+		_left = constrain(left, -255, 255);
+		_right = constrain(right, -255, 255);
+		int l = INVERTER ? -_left : _left;
+		int r = INVERTER ? -_right : _right;
+
+		// Forward is in1 high, backward is in2 high, and both low coasts
+		byte bits = 0;
+		if (l > 0) bits |= FastPin<IN1>::mask;
+		if (l < 0) bits |= FastPin<IN2>::mask;
+		if (r > 0) bits |= FastPin<IN3>::mask;
+		if (r < 0) bits |= FastPin<IN4>::mask;
+		fastPortWrite<FastPin<IN1>::port_id>(DIR_MASK, bits);
+
+		FastPin<EN1>::pwm(abs(l));
+		FastPin<EN2>::pwm(abs(r));
+	}
+private:
+	static const byte DIR_MASK = FastPin<IN1>::mask | FastPin<IN2>::mask | FastPin<IN3>::mask | FastPin<IN4>::mask;
+	int _left = 0;
+	int _right = 0;
+};
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,106 @@
+/* 
+
+A fixed size queue (first in, first out), kept in a ring buffer. Unlike
+QueueList, nothing is ever allocated: the space for every item is part of the
+queue itself, so it's all counted when compiling, and pushing and popping
+can't break the heap up into pieces. Every operation (including clear) takes
+the same time, however full the queue is.
+
+	RingQueue<int, 8> numbers; // Up to 8 ints
+	numbers.push(3);
+	int first = numbers.pop();
+
+What happens when it's full is up to the policy (the third template
+parameter): RING_REJECT (the default) turns the new item away, and
+RING_OVERWRITE drops the oldest item to make room.
+
+License: GPLv3
+
+*/
+
+#ifndef ringqueue_h
+#define ringqueue_h
+
+// Pull in the Arduino standard libraries
+#if ARDUINO >= 100
+  #include "Arduino.h"
+#else
+  #include "WProgram.h"
+  #include "pins_arduino.h"
+  #include "WConstants.h"
+#endif
+
+#define RING_REJECT 0 // When full, push() turns the new item away (and returns false)
+#define RING_OVERWRITE 1 // When full, push() drops the oldest item to make room
+
+template <typename T, byte CAPACITY, byte POLICY = RING_REJECT>
+class RingQueue
+{
+public:
+	static_assert(CAPACITY > 0, "RingQueue needs room for at least one item");
+
+	RingQueue() {};
+
+	// Adds an item to the back. False if it didn't fit (RING_REJECT only).
+	bool push(const T & item) {
+		if (_count == CAPACITY) {
+			if (POLICY == RING_REJECT) {
+				return false;
+			}
+			_head = next(_head); // Drop the oldest
+			_count--;
+		}
+		_items[index(_count)] = item;
+		_count++;
+		return true;
+	}
+
+	// Takes the item off the front. Popping an empty queue returns T().
+	T pop() {
+		if (_count == 0) {
+			return T();
+		}
+		T item = _items[_head];
+		_head = next(_head);
+		_count--;
+		return item;
+	}
+
+	// Drops the item off the front (without copying it). False if there wasn't one.
+	bool drop() {
+		if (_count == 0) {
+			return false;
+		}
+		_head = next(_head);
+		_count--;
+		return true;
+	}
+
+	// The item at the front (NULL if empty). It stays valid until it's popped.
+	T * peek() { return (_count > 0) ? &_items[_head] : NULL; }
+	const T * peek() const { return (_count > 0) ? &_items[_head] : NULL; }
+
+	// The item `age` places from the front (NULL if there isn't one)
+	T * at(byte age) { return (age < _count) ? &_items[index(age)] : NULL; }
+	const T * at(byte age) const { return (age < _count) ? &_items[index(age)] : NULL; }
+
+	void clear() { _count = 0; } // Forgets every item
+	void truncate(byte keep) { _count = min(_count, keep); } // Forgets all but the first `keep` items
+
+	byte count() const { return _count; }
+	bool isEmpty() const { return _count == 0; }
+	bool isFull() const { return _count == CAPACITY; }
+	byte capacity() const { return CAPACITY; }
+private:
+	T _items[CAPACITY];
+	byte _head = 0; // Index of the front item
+	byte _count = 0;
+
+	static byte next(byte i) { return (i + 1 == CAPACITY) ? 0 : i + 1; }
+	byte index(byte age) const { // Both are under CAPACITY, so one wrap is enough (and no division)
+		int i = _head + age;
+		return (i >= CAPACITY) ? i - CAPACITY : i;
+	}
+};
+
+#endif
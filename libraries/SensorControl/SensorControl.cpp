@@ -24,7 +24,17 @@ void SensorControl::setSensorPins(int front, int right, int rear, int left, int
 	right_sonar = NewPing(right, right, MAX_SONAR_DIST/10);
 	rear_sonar = NewPing(rear, rear, MAX_SONAR_DIST/10); 
 	left_sonar  = NewPing(left, left, MAX_SONAR_DIST/10); 
+	_sonar_pins[SONAR_FRONT] = front;
+	_sonar_pins[SONAR_RIGHT] = right;
+	_sonar_pins[SONAR_REAR] = rear;
+	_sonar_pins[SONAR_LEFT] = left;
+	for (int i = 0; i < SONAR_COUNT; ++i) {
+		_sonar_range[i] = fullRange();
+	}
 	floor1 = TCRT5000(line_tracker); // We only have a receiving pin
+	_last_floor_state = floor1.isClose();
+	_last_floor_time = millis();
+	setupFloorCapture(line_tracker);
 
 	// Activate the Magnetic Sensor
 	// Note that we have a serial output so we can detect if we have a freeze
@@ -32,6 +42,8 @@ void SensorControl::setSensorPins(int front, int right, int rear, int left, int
 	mag.begin();
 	mag.setRange(HMC5883L_RANGE_8_1GA);
 	mag.setDataRate(HMC5883L_DATARATE_75HZ);
+	_mag_q8 = mag.getMgPerDigit() * 256 + 0.5; // Fixed point from here on
+	loadMagCalibration();
 	if (Serial) Serial.println("Activated.");
 }
 
@@ -53,39 +65,48 @@ void SensorControl::fillDistArray(Array<int> array) {
 
 // INDIVIDUAL SONARS:
 int SensorControl::getFrontDistance() {
-	return getDistance(front_sonar);
+	return getDistance(SONAR_FRONT);
 }
 
 int SensorControl::getRightDistance() {
-	int dist = getDistance(right_sonar);
-	pushToBlipStore(dist, _r_blip_hist);
-	return dist;
+	return getDistance(SONAR_RIGHT);
 }
 
 int SensorControl::getRearDistance() {
-	return getDistance(rear_sonar);
+	return getDistance(SONAR_REAR);
 }
 
 int SensorControl::getLeftDistance() {
-	int dist = getDistance(left_sonar);
-	pushToBlipStore(dist, _l_blip_hist);
-	return dist;
+	return getDistance(SONAR_LEFT);
 }
 
 
 // Returns the distance ping in mm (rather than cm)
-// Takes a sensor object and returns its median ping times 10 (convert to mm).
-int SensorControl::getDistance(NewPing sonar) {
+// If the sonar engine is running, this is just the cached reading. Otherwise,
+// we ping the sonar once and run it through the filter. With the filter off,
+// we fall back to the median of PING_COUNT pings.
+int SensorControl::getDistance(int side) {
+	if (_engine.isOn()) {
+		run(); // Pick up anything that has come back since we last looked
+		return _sonar_cache[side].dist;
+	}
+
 	delay(getPingDelay()); // Stop crosstalk
-	int dist = NewPing::convert_cm(sonar.ping_median(PING_COUNT)) * 10;
-	_last_ping_time = millis();
-	return dist;
+	unsigned long echo;
+	if (_filters[side].getWindow() > 1) {
+		echo = _sonars[side]->ping(_sonar_range[side]);
+	} else {
+		echo = _sonars[side]->ping_median(PING_COUNT, _sonar_range[side]);
+	}
+	_engine.donePing(millis());
+	storeReading(side, NewPing::convert_cm(echo) * 10);
+	return _sonar_cache[side].dist;
 } 
 
 // From current time and the last ping time, return a 
 // suitable minimal delay (in ms). Based on PING_INTERVAL.
 int SensorControl::getPingDelay() {
-	int ping_diff = abs(millis() - _last_ping_time);
+	int ping_diff = abs(millis() - _engine.getLastPing());
 	if (ping_diff > PING_INTERVAL) {
 		return 0;
 	} else {
@@ -93,63 +114,703 @@ int SensorControl::getPingDelay() {
 	}
 }
 
+// Keeps the latest (filtered) reading of each sonar, and pushes the raw
+// readings of the sides into the blip stores (a filter would hide the blips).
+void SensorControl::storeReading(int side, int dist) {
+	adaptRange(side, dist);
+	_sonar_cache[side].s_time = millis();
+	_sonar_cache[side].dist = _filters[side].push(dist, _sonar_cache[side].s_time);
+	_sonar_cache[side].valid = true;
 
-// Blipping
+	if (side == SONAR_RIGHT) {
+		_r_blips.push(dist, _sonar_cache[side].s_time);
+	} else if (side == SONAR_LEFT) {
+		_l_blips.push(dist, _sonar_cache[side].s_time);
+	}
 
-void SensorControl::getLeftBlipped(Array<int> out) {
-	getBlippedFromStore(_l_blip_hist, out);
+	// Feed the wall fits (only as we move, so a stop doesn't crowd the window)
+	int wall = wallIndex(side);
+	int filtered = _sonar_cache[side].dist;
+	if (wall >= 0 && filtered > 0 && filtered <= WALL_MAX_DIST &&
+		abs(_travelled - _wall_last[wall]) >= WALL_MIN_STEP) {
+		_walls[wall].push(_travelled, filtered);
+		_wall_last[wall] = _travelled;
+	}
 }
 
-void SensorControl::getRightBlipped(Array<int> out) {
-	getBlippedFromStore(_r_blip_hist, out);
-}
-
-// Searches the blip_store for a blip and returns "now - timestamp". Otherwise, -1.
-void SensorControl::getBlippedFromStore(PingCapture blip_store[], Array<int> out) {
-	int expected = 0;
-	int rising_edge = BLIP_HIST; // Start here so the next loop won't run if there's no edge
-	
-	// We start i at 1 so we have something to compare with in the algorithm
-	for (int i = 1; i < BLIP_HIST; ++i)	{
-		// Must be a negative difference, otherwise not a rising edge
-		if (blip_store[i].dist - blip_store[i - 1].dist < -1 * BLIP_THRESHOLD) {
-			// Store what we expect, so we can compare the falling edge in the next loop
-			rising_edge = i;
-			expected = blip_store[i - 1].dist;
-			break;
+/*
+
+A ping that doesn't come back costs the full listening range, even if the wall
+was right there a moment ago. So each sonar only listens a little further
+(ADAPT_MARGIN) than its last reading. Things can't move far between pings, so
+that's usually enough. If the echo doesn't make it back in time, the next ping
+of that sonar listens to the full range again (the filter holds the last value
+in the meantime).
+
+*/
+void SensorControl::adaptRange(int side, int dist) {
+	if (_adapt_range && dist > 0) {
+		_sonar_range[side] = constrain(dist + ADAPT_MARGIN, ADAPT_MIN_DIST, fullRange() * 10) / 10;
+	} else {
+		_sonar_range[side] = fullRange();
+	}
+}
+
+unsigned int SensorControl::fullRange() const {
+	return min(MAX_SONAR_DIST, ARENA_MAX_DIST) / 10;
+}
+
+void SensorControl::setAdaptiveRange(bool adapt) {
+	_adapt_range = adapt;
+	for (int i = 0; i < SONAR_COUNT; ++i) {
+		_sonar_range[i] = fullRange();
+	}
+}
+
+SonarReading SensorControl::getSonarReading(int side) {
+	if (_engine.isOn()) {
+		run();
+	}
+	return _sonar_cache[constrain(side, 0, SONAR_COUNT - 1)];
+}
+
+
+void SensorControl::setSonarFilter(byte window, float hampel_k, byte zero_limit) {
+	for (int i = 0; i < SONAR_COUNT; ++i) {
+		_filters[i].setup(window, hampel_k, zero_limit);
+	}
+}
+
+
+// Sonar filters
+
+void SonarFilter::setup(byte window, float hampel_k, byte zero_limit) {
+	_window = constrain(window, 1, FILTER_MAX_WINDOW);
+	_k10 = constrain(hampel_k * 10, 0, 255);
+	_zero_limit = max(zero_limit, 1);
+	reset();
+}
+
+void SonarFilter::reset() {
+	_head = 0;
+	_count = 0;
+	_zeros = 0;
+}
+
+int SonarFilter::push(int dist, unsigned long now) {
+	// Pings from before a pause are of a different scene
+	if (now - _last_time > FILTER_MAX_AGE) {
+		reset();
+		_value = 0;
+	}
+	_last_time = now;
+
+	// Hold on to the last value until we're sure there's really no echo
+	if (dist <= 0) {
+		if (++_zeros < _zero_limit) {
+			return _value;
+		}
+		reset();
+		_value = 0;
+		return _value;
+	}
+	_zeros = 0;
+
+	// Window full, so the oldest ping makes way (in both orderings)
+	int slot;
+	if (_count == _window) {
+		int oldest = _ring[_head];
+		for (slot = 0; _sorted[slot] != oldest; ++slot) {}
+		for (; slot < _count - 1; ++slot) {
+			_sorted[slot] = _sorted[slot + 1];
+		}
+		_count--;
+		_ring[_head] = dist;
+		_head = (_head + 1) % _window;
+	} else {
+		_ring[(_head + _count) % _window] = dist;
+	}
+
+	// Insertion into the sorted copy
+	for (slot = _count; slot > 0 && _sorted[slot - 1] > dist; --slot) {
+		_sorted[slot] = _sorted[slot - 1];
+	}
+	_sorted[slot] = dist;
+	_count++;
+
+	int median = _sorted[_count / 2];
+	if (_k10 == 0) {
+		_value = median;
+		return _value;
+	}
+
+	// Hampel test: median absolute deviation, found by walking out from the
+	// median through the sorted pings (nearest first).
+	int lo = _count / 2 - 1, hi = _count / 2 + 1, mad = 0;
+	for (int i = 0; i < _count / 2 + 1; ++i) {
+		int below = (lo >= 0) ? median - _sorted[lo] : 32767;
+		int above = (hi < _count) ? _sorted[hi] - median : 32767;
+		if (i == 0) {
+			mad = 0; // The median itself
+		} else if (below < above) {
+			mad = below;
+			lo--;
+		} else {
+			mad = above;
+			hi++;
+		}
+	}
+	mad = max(mad, FILTER_MIN_MAD);
+
+	// 1.4826 scales the MAD to a standard deviation (for normal noise)
+	if ((long) abs(dist - median) * 10 > (long) _k10 * mad * 1.4826) {
+		_value = median;
+	} else {
+		_value = dist;
+	}
+	return _value;
+}
+
+
+// Sonar engine
+
+/*
+
+The engine pings one sonar at a time, going clockwise from the front. Instead
+of waiting for the echo like NewPing does, the echo pin is watched by a pin
+change interrupt which timestamps the start and end of the echo pulse. run()
+then turns those timestamps into a distance and fires the next sonar once
+PING_INTERVAL has passed. The timing lives in SonarEngine (which never
+touches the hardware, so it can be tested on a PC), and the pins are
+handled here. The pin change interrupt is used (rather than
+NewPing's Timer2 echo check) because Timer2 also drives the PWM on pin 3.
+
+All sonar pins need to be on the same port of the PCINT0 group (pins 8 to 13
+on the UNO).
+
+*/
+
+SensorControl * SensorControl::_isr_owner = NULL;
+
+bool SensorControl::startSonars() {
+	if (!setupCapture()) {
+		return false;
+	}
+	_engine.start();
+	return true;
+}
+
+void SensorControl::stopSonars() {
+	if (_engine.isPinging()) {
+		releaseSonar(_engine.getSide());
+		finishPing(NO_ECHO);
+	}
+	_engine.stop();
+}
+
+bool SensorControl::isSonarsRunning() const {
+	return _engine.isOn();
+}
+
+void SensorControl::run() {
+	if (_snap_interval > 0 && millis() - _snap_time >= (unsigned long) _snap_interval) {
+		_snap_time = millis();
+		readMag();
+		readFloor();
+	}
+
+	if (!_engine.isOn()) {
+		return;
+	}
+
+	if (_engine.isPinging()) {
+		int dist = checkEcho(_engine.getSide());
+		if (dist != ECHO_WAITING) {
+			releaseSonar(_engine.getSide());
+			finishPing(dist);
+		}
+		return;
+	}
+
+	// The engine waits out the crosstalk interval before the next ping
+	int side = _engine.nextPing(millis());
+	if (side >= 0) {
+		fireSonar(side);
+	}
+}
+
+// Checks the sonar pins can be captured by the interrupt, and turns it on
+bool SensorControl::setupCapture() {
+	for (int i = 0; i < SONAR_COUNT; ++i) {
+		byte pin = _sonar_pins[i];
+		if (digitalPinToPCICR(pin) == 0 || digitalPinToPCICRbit(pin) != 0 ||
+			digitalPinToPort(pin) != digitalPinToPort(_sonar_pins[0])) {
+			if (F_DEBUG && Serial) Serial.println("Sonar capture needs all sonars on pins 8-13");
+			return false;
+		}
+		_sonar_bits[i] = digitalPinToBitMask(pin);
+		_engine.setBit(i, _sonar_bits[i]);
+	}
+
+	_isr_owner = this;
+	_echo_port = portInputRegister(digitalPinToPort(_sonar_pins[0]));
+	*digitalPinToPCICR(_sonar_pins[0]) |= _BV(digitalPinToPCICRbit(_sonar_pins[0]));
+	return true;
+}
+
+// Sends a trigger pulse on a sonar, then lets the interrupt listen for its echo
+void SensorControl::fireSonar(int side) {
+	byte pin = _sonar_pins[side];
+
+	// Trigger and echo are the same pin, so drive it for the pulse, then let go.
+	pinMode(pin, OUTPUT);
+	digitalWrite(pin, LOW);
+	delayMicroseconds(4);
+	digitalWrite(pin, HIGH);
+	delayMicroseconds(10);
+	digitalWrite(pin, LOW);
+	pinMode(pin, INPUT);
+
+	noInterrupts();
+	_engine.arm(side, micros(), *_echo_port);
+	*digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+	interrupts();
+}
+
+// Returns the distance (in mm) once the echo is over (NO_ECHO if nothing came
+// back), or ECHO_WAITING if we're still listening.
+int SensorControl::checkEcho(int side) {
+	return _engine.check(side, micros(), _sonar_range[side]);
+}
+
+// Stops listening to a sonar's pin
+void SensorControl::releaseSonar(int side) {
+	byte pin = _sonar_pins[side];
+
+	noInterrupts();
+	*digitalPinToPCMSK(pin) &= ~_BV(digitalPinToPCMSKbit(pin));
+	_engine.release(side);
+	interrupts();
+}
+
+// Stores the reading of the engine's sonar, and frees the engine
+void SensorControl::finishPing(int dist) {
+	_engine.donePing(millis());
+	storeReading(_engine.getSide(), dist);
+}
+
+// Hands the sonar pins to the engine (which timestamps the echo pulses) and
+// timestamps any change of the floor
+void SensorControl::handlePinChange() {
+	SensorControl * self = _isr_owner;
+	if (self == NULL) {
+		return;
+	}
+
+	if (self->_floor_bit) {
+		bool main = !(*self->_floor_port & self->_floor_bit); // Same as TCRT5000::isClose()
+		if (main != self->_floor_isr_main) {
+			self->_floor_isr_main = main;
+			byte head = self->_floor_head;
+			byte next = (head + 1) % FLOOR_EVENTS;
+			if (next == self->_floor_tail) {
+				self->_floor_overflow = true; // Full. drainFloor() catches up by reading the pin.
+			} else {
+				self->_floor_event_time[head] = millis();
+				self->_floor_event_main[head] = main;
+				self->_floor_head = next; // Written last, so the slot is ready before it's seen
+			}
+		}
+	}
+
+	if (self->_engine.isListening()) {
+		byte port = *self->_echo_port;
+		self->_engine.edge(micros(), port);
+	}
+}
+
+#if defined(__AVR__)
+ISR(PCINT0_vect) {
+	SensorControl::handlePinChange();
+}
+#endif
+
+
+// Snapshots
+
+/*
+
+A snapshot pings the sonars in pairs that face away from each other (front
+and rear, then right and left), so two sonars are listening at once and the
+full ring takes two echo windows instead of four. Within a pair the triggers
+are staggered by SNAPSHOT_STAGGER us. If both echoes of a pair end within
+SNAPSHOT_XTALK us of each other, they most likely heard the same sound, so the
+reading of the sonar that fired second is thrown away and it gets pinged again
+on its own.
+
+*/
+
+bool SensorControl::fillDistSnapshot(Array<int> array) {
+	bool paired = pingAll();
+	for (int i = 0; i < SONAR_COUNT; ++i) {
+		array[i] = _sonar_cache[i].dist;
+	}
+	return paired;
+}
+
+bool SensorControl::pingAll() {
+	// Let the engine finish what it's doing, then keep it out of the way
+	bool resume = _engine.isOn();
+	while (_engine.isPinging()) {
+		run();
+	}
+	_engine.stop();
+
+	if (!setupCapture()) {
+		for (int i = 0; i < SONAR_COUNT; ++i) {
+			getDistance(i);
 		}
+		if (resume) {
+			_engine.start();
+		}
+		return false;
+	}
+
+	int dists[SONAR_COUNT];
+	const byte pairs[2][2] = {{SONAR_FRONT, SONAR_REAR}, {SONAR_RIGHT, SONAR_LEFT}};
+	for (int p = 0; p < 2; ++p) {
+		pingGroup(pairs[p], 2, dists);
 	}
 
-	// If we have a rising edge, this will run and return something if there's a falling edge
-	for (int i = rising_edge; i < BLIP_HIST; ++i) {
-		// If the value in the store is close enough to the value before the falling edge...
-		if (abs(blip_store[i].dist - expected) < BLIP_RETURN_THRESHOLD) {
-			out[0] = blip_store[rising_edge].dist; 				// Then return the distance of the edge...
-			out[1] = millis() - blip_store[rising_edge].s_time; // And return the time of the rising edge.
+	// Anything thrown away as crosstalk gets another go, on its own
+	for (byte i = 0; i < SONAR_COUNT; ++i) {
+		if (dists[i] == ECHO_WAITING) {
+			pingGroup(&i, 1, dists);
 		}
 	}
 
-	// We didn't find a falling edge to the right value, or no edges at all
-	out[0] = -1;
-	out[1] = -1;
-	return;
+	for (int i = 0; i < SONAR_COUNT; ++i) {
+		storeReading(i, max(dists[i], 0));
+	}
+
+	if (resume) {
+		_engine.start();
+	}
+	return true;
 }
 
-void SensorControl::pushToBlipStore(int dist, PingCapture blip_store[]) {
-	// Iterate backwards for a shift-then-overwrite routine
-	for (int i = BLIP_HIST - 1; i >= 0; --i) {	
-		if (i > 0) { // If we're in the thick of it:
-			// Replace each member with the next most recent
-			blip_store[i] = blip_store[i - 1];
-			// (Effectively a right shift)
-		} else if (i == 0) { // Otherwise, we're at the top of the history
-			// So put our new value in the right spot
-			blip_store[i].dist = dist; // Store distance
-			blip_store[i].s_time = millis(); // Then store the timestamp
+// Pings a group of sonars (staggered), and waits for all of their echoes.
+// Readings rejected as crosstalk are left as ECHO_WAITING in dists.
+void SensorControl::pingGroup(const byte sides[], int count, int dists[]) {
+	delay(getPingDelay()); // Stop crosstalk from the last group
+
+	for (int k = 0; k < count; ++k) {
+		if (k > 0) {
+			delayMicroseconds(SNAPSHOT_STAGGER);
+		}
+		fireSonar(sides[k]);
+		dists[sides[k]] = ECHO_WAITING;
+	}
+
+	int waiting = count;
+	while (waiting > 0) {
+		waiting = 0;
+		for (int k = 0; k < count; ++k) {
+			byte side = sides[k];
+			if (dists[side] != ECHO_WAITING) {
+				continue;
+			}
+			int dist = checkEcho(side);
+			if (dist == ECHO_WAITING) {
+				waiting++;
+			} else {
+				releaseSonar(side);
+				dists[side] = dist;
+			}
+		}
+	}
+	_engine.donePing(millis());
+
+	// Crosstalk check. Later sonars lose to earlier ones.
+	for (int k = 1; k < count; ++k) {
+		for (int j = 0; j < k; ++j) {
+			byte early = sides[j], late = sides[k];
+			if (dists[early] > 0 && dists[late] > 0 &&
+				abs((long) (_engine.getFall(late) - _engine.getFall(early))) < SNAPSHOT_XTALK) {
+				dists[late] = ECHO_WAITING;
+			}
 		}
 	}
 }
 
+
+/*
+
+Snapshots
+
+Everything a decision needs, in one struct, with the time each reading was
+taken. If the sonar engine is running, the sonar readings come straight from
+it (no waiting). Otherwise all four sonars are pinged (see fillDistSnapshot).
+If setSnapshotInterval(...) is on, run() keeps the mag and floor readings
+fresh too, so filling a snapshot doesn't touch the sensors at all.
+
+*/
+
+void SensorControl::fillSnapshot(SensorSnapshot & snap) {
+	if (!_engine.isOn()) {
+		pingAll();
+	}
+	if (_snap_interval <= 0) {
+		readMag();
+		readFloor();
+	}
+
+	for (int i = 0; i < SONAR_COUNT; ++i) {
+		snap.sonars[i] = _sonar_cache[i];
+	}
+	snap.mag = _mag_cache;
+	snap.floor = _floor_cache;
+}
+
+void SensorControl::setSnapshotInterval(int interval) {
+	_snap_interval = max(interval, 0);
+	_snap_time = millis() - _snap_interval; // Read on the next run()
+}
+
+void SensorControl::readFloor() {
+	_floor_cache.main = isFloorMain();
+	_floor_cache.type = getFloorType();
+	_floor_cache.s_time = millis();
+	_floor_cache.valid = true;
+}
+
+
+/*
+
+Wall fitting
+
+As we drive along a wall, the side sonar reading changes by -tan(angle) for
+every mm we travel (where angle is how far we're pointed towards the wall).
+So the slope of the fitted line gives the angle, and the fitted distance
+right now (times cos(angle)) gives how far across the wall is.
+
+*/
+
+void SensorControl::setTravelled(float dist) {
+	_travelled = dist;
+}
+
+void SensorControl::resetWallFit() {
+	for (int i = 0; i < 2; ++i) {
+		_walls[i].reset();
+		_wall_last[i] = _travelled - WALL_MIN_STEP; // Take the next ping straight away
+	}
+}
+
+bool SensorControl::isWallFitValid(int side) {
+	int wall = wallIndex(side);
+	return wall >= 0 && _walls[wall].isValid();
+}
+
+float SensorControl::getWallAngle(int side) {
+	if (!isWallFitValid(side)) {
+		return 0;
+	}
+	float angle = atan(_walls[wallIndex(side)].getSlope()) * 180 / PI;
+	// Closing in on the right wall means we're turned right (and vice versa)
+	return (side == SONAR_RIGHT) ? -angle : angle;
+}
+
+int SensorControl::getWallOffset(int side) {
+	if (!isWallFitValid(side)) {
+		return 0;
+	}
+	const WallFit & fit = _walls[wallIndex(side)];
+	return fit.getDistanceAt(_travelled) * cos(atan(fit.getSlope()));
+}
+
+int SensorControl::wallIndex(int side) const {
+	if (side == SONAR_RIGHT) {
+		return 0;
+	} else if (side == SONAR_LEFT) {
+		return 1;
+	}
+	return -1;
+}
+
+void WallFit::push(float s, int dist) {
+	// Something in the way (or a gap in the wall) shouldn't bend the fit.
+	// If it keeps happening though, the wall has moved (e.g. a corner).
+	if (isValid() && abs(dist - getDistanceAt(s)) > WALL_GATE) {
+		if (++_misses < WALL_GATE_LIMIT) {
+			return;
+		}
+		reset();
+	}
+	_misses = 0;
+
+	if (_count == 0) {
+		_s0 = s;
+	}
+
+	byte index;
+	if (_count < WALL_WINDOW) {
+		index = (_head + _count) % WALL_WINDOW;
+		_count++;
+	} else {
+		// Drop the oldest ping to make room
+		add(_s[_head], _d[_head], -1);
+		index = _head;
+		_head = (_head + 1) % WALL_WINDOW;
+	}
+	_s[index] = s - _s0;
+	_d[index] = dist;
+	add(_s[index], dist, 1);
+
+	if (++_pushes >= WALL_WINDOW) {
+		rebuild();
+	}
+}
+
+void WallFit::add(float s, int dist, int sign) {
+	_sum_s += sign * s;
+	_sum_d += sign * dist;
+	_sum_ss += sign * s * s;
+	_sum_sd += sign * s * dist;
+}
+
+void WallFit::rebuild() {
+	float shift = _s[_head]; // Measure from the oldest ping again
+	_s0 += shift;
+	_sum_s = _sum_d = _sum_ss = _sum_sd = 0;
+	for (int k = 0; k < _count; ++k) {
+		byte i = (_head + k) % WALL_WINDOW;
+		_s[i] -= shift;
+		add(_s[i], _d[i], 1);
+	}
+	_pushes = 0;
+}
+
+void WallFit::reset() {
+	_head = 0;
+	_count = 0;
+	_misses = 0;
+	_pushes = 0;
+	_sum_s = _sum_d = _sum_ss = _sum_sd = 0;
+}
+
+bool WallFit::isValid() const {
+	if (_count < 4) {
+		return false;
+	}
+	float low = _s[_head], high = _s[_head];
+	for (int k = 1; k < _count; ++k) {
+		float s = _s[(_head + k) % WALL_WINDOW];
+		low = min(low, s);
+		high = max(high, s);
+	}
+	return high - low >= WALL_MIN_SPAN;
+}
+
+float WallFit::getSlope() const {
+	float spread = _count * _sum_ss - _sum_s * _sum_s;
+	if (spread <= 0) {
+		return 0;
+	}
+	return (_count * _sum_sd - _sum_s * _sum_d) / spread;
+}
+
+float WallFit::getDistanceAt(float s) const {
+	if (_count == 0) {
+		return 0;
+	}
+	float mean_s = _sum_s / _count;
+	float mean_d = _sum_d / _count;
+	return mean_d + getSlope() * (s - _s0 - mean_s);
+}
+
+
+// Blipping
+
+void SensorControl::getLeftBlipped(Array<int> out) {
+	getBlippedFromStore(_l_blips, out);
+}
+
+void SensorControl::getRightBlipped(Array<int> out) {
+	getBlippedFromStore(_r_blips, out);
+}
+
+// Fills out with the distance and "now - timestamp" of the last blip. Otherwise, -1.
+void SensorControl::getBlippedFromStore(const BlipStore & store, Array<int> out) {
+	PingCapture blip;
+	if (store.getBlip(blip)) {
+		out[0] = blip.dist;
+		out[1] = millis() - blip.s_time;
+	} else {
+		out[0] = -1;
+		out[1] = -1;
+	}
+}
+
+void BlipStore::push(int dist, unsigned long s_time) {
+	// No echo (or a very long one) is treated as "far away", so that noise
+	// doesn't look like a blip.
+	if (dist <= 0 || dist > BLIP_CAP) {
+		dist = BLIP_CAP;
+	}
+
+	int prev = _hist[_head].dist;
+	bool first = (_count == 0);
+
+	// Overwrite the oldest ping
+	_head = (_head + 1) % BLIP_HIST;
+	_hist[_head].dist = dist;
+	_hist[_head].s_time = s_time;
+	if (_count < BLIP_HIST) {
+		_count++;
+	}
+	_seq++;
+
+	if (first) {
+		return; // Nothing to compare with yet
+	}
+
+	// A blip that started before the oldest ping in history has been missed
+	if (_in_blip && _seq - _edge_seq >= BLIP_HIST) {
+		_in_blip = false;
+	}
+
+	if (!_in_blip) {
+		// Look for a falling edge (reading suddenly gets closer)
+		if (dist - prev < -1 * BLIP_THRESHOLD) {
+			_in_blip = true;
+			_expected = prev;
+			_edge = _hist[_head];
+			_edge_seq = _seq;
+		}
+	} else if (abs(dist - (int) _expected) < BLIP_RETURN_THRESHOLD) {
+		// Rising edge back to where we were, so that was a blip
+		_in_blip = false;
+		_has_blip = true;
+		_blip = _edge;
+		_blip_seq = _edge_seq;
+	}
+}
+
+bool BlipStore::getBlip(PingCapture & blip) const {
+	// Blips are forgotten once their first ping drops out of the history
+	if (!_has_blip || _seq - _blip_seq >= BLIP_HIST) {
+		return false;
+	}
+	blip = _blip;
+	return true;
+}
+
+PingCapture BlipStore::getPing(int age) const {
+	age = constrain(age, 0, BLIP_HIST - 1);
+	return _hist[(_head + BLIP_HIST - age) % BLIP_HIST];
+}
+
 /*
 
 Line Tracking Sensor
@@ -157,8 +818,18 @@ Line Tracking Sensor
 */
 
 // This is a wrapper around the .isClose() function with timing logic.
-// Everything is based on this.
+// Everything is based on this. If the line tracker is on a pin the interrupt
+// can watch, the changes have already been timestamped, so this just catches
+// up on them.
 bool SensorControl::isFloorMain() {
+	if (floor1.isAnalog()) {
+		_last_floor_time = floor1.getClassTime();
+		return getFloorType() != FLOOR_START;
+	}
+	if (_floor_bit) {
+		drainFloor();
+		return _last_floor_state;
+	}
 	bool floor_state = floor1.isClose();
 	if (_last_floor_state != floor_state) {
 		_last_floor_time = millis();
@@ -173,6 +844,9 @@ bool SensorControl::isFloorStart() {
 
 
 short SensorControl::getFloorType() {
+	if (floor1.isAnalog()) {
+		return _floor_types[floor1.getClass()];
+	}
 	if (isFloorMain()) {
 		return 2;
 	} else {
@@ -188,9 +862,110 @@ bool SensorControl::hasFloorChanged(int interval = 100) {
 }
 
 int SensorControl::getTimeFloorLastChanged() {
+	if (_floor_bit || floor1.isAnalog()) {
+		isFloorMain(); // Catch up on what the interrupts saw
+	}
 	return (millis() - _last_floor_time);
 }
 
+// The analog output tells more than light or dark, so the floor can be sorted
+// into up to TCRT_MAX_CLASSES classes (start, ramp, main and upper to start
+// with). The ADC does the sampling in the background, see TCRT5000.
+bool SensorControl::setFloorAnalog(int analog_pin, int emitter) {
+	if (!floor1.beginAnalog(analog_pin, emitter)) {
+		return false;
+	}
+
+	// The digital pin isn't needed any more
+	if (_floor_bit) {
+		noInterrupts();
+		*digitalPinToPCMSK(_floor_pin) &= ~_BV(digitalPinToPCMSKbit(_floor_pin));
+		_floor_bit = 0;
+		interrupts();
+	}
+
+	const int bounds[] = FLOOR_BOUNDS;
+	const short types[] = FLOOR_TYPES;
+	setFloorClasses(bounds, types, FLOOR_CLASSES);
+	return true;
+}
+
+// bounds has count - 1 levels in it (the ones between the classes, darkest
+// first), and types has the floor type of each of the count classes
+void SensorControl::setFloorClasses(const int bounds[], const short types[], byte count, int hysteresis) {
+	count = constrain(count, 1, TCRT_MAX_CLASSES);
+	for (byte i = 0; i < count; ++i) {
+		_floor_types[i] = types[i];
+	}
+	floor1.setClasses(bounds, count - 1, hysteresis);
+}
+
+int SensorControl::getFloorLevel() {
+	return floor1.isAnalog() ? floor1.getLevel() : -1;
+}
+
+// The digital output is either right or wrong, so it's always sure
+float SensorControl::getFloorConfidence() {
+	return floor1.isAnalog() ? floor1.getConfidence() : 1;
+}
+
+// Turns on the pin change interrupt for the line tracker. It has to share
+// the sonars' interrupt (pins 8-13), otherwise the floor is polled instead.
+bool SensorControl::setupFloorCapture(int pin) {
+	if (digitalPinToPCICR(pin) == 0 || digitalPinToPCICRbit(pin) != 0) {
+		if (F_DEBUG && Serial) Serial.println("Floor capture needs the line tracker on pins 8-13");
+		return false;
+	}
+
+	noInterrupts();
+	_isr_owner = this;
+	_floor_pin = pin;
+	_floor_port = portInputRegister(digitalPinToPort(pin));
+	_floor_bit = digitalPinToBitMask(pin);
+	_floor_isr_main = _last_floor_state;
+	_floor_head = _floor_tail = 0;
+	*digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+	*digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+	interrupts();
+	return true;
+}
+
+// A change only counts once the floor has stayed that way for
+// FLOOR_DEBOUNCE ms, so a bounce (or a speck on the floor) is ignored. Each
+// change waits in _floor_pending until the next one shows up (or enough
+// time passes). The ring never holds more than FLOOR_EVENTS, so this doesn't
+// take long, however long it's been.
+void SensorControl::drainFloor() {
+	while (_floor_tail != _floor_head) {
+		floorEvent(_floor_event_time[_floor_tail], _floor_event_main[_floor_tail]);
+		_floor_tail = (_floor_tail + 1) % FLOOR_EVENTS;
+	}
+
+	if (_floor_overflow) {
+		// Some changes were lost, so all we know is where the floor is now
+		noInterrupts();
+		_floor_overflow = false;
+		bool main = _floor_isr_main;
+		interrupts();
+		floorEvent(millis(), main);
+	}
+
+	if (_floor_pending && millis() - _floor_pending_time >= FLOOR_DEBOUNCE) {
+		floorEvent(millis(), _floor_pending_main); // Nothing since, so it's held
+	}
+}
+
+void SensorControl::floorEvent(unsigned long s_time, bool main) {
+	if (_floor_pending && s_time - _floor_pending_time >= FLOOR_DEBOUNCE &&
+		_floor_pending_main != _last_floor_state) {
+		_last_floor_state = _floor_pending_main;
+		_last_floor_time = _floor_pending_time;
+	}
+	_floor_pending = (main != _last_floor_state);
+	_floor_pending_main = main;
+	_floor_pending_time = s_time;
+}
+
 
 
 /*
@@ -199,76 +974,706 @@ int SensorControl::getTimeFloorLastChanged() {
 
 */
 
-// Returns 3D vector magnitude
-float magtd3(float a, float b, float c) {
-	return sqrt(square(abs(a)) + square(abs(b)) + square(abs(c)));
-}
+/*
 
-// Modifies an x,y,z array of ints with field components
-void SensorControl::getMagComponents(Array<float> array) {
+Every mag getter reads from the same cache, which is only refreshed when the
+sensor has a new reading for us (every MAG_PERIOD). All six output registers
+are read in a single I2C transaction, rather than one per axis.
+
+Everything is kept in whole milligauss (ints), so there's no float maths on
+the way through. The strength is kept squared for the range check, and the
+angles come from the integer atan2 in ARDVARC_UTIL.
+
+There's no data ready pin to watch (and the status register's ready bit
+stays set after the data has been read, so it can't tell old from new), so
+the sensor is just read every MAG_PERIOD. Now and then that picks up the same
+sample twice, as our clock and the sensor's drift apart, but a repeat is
+still a real reading. Telling repeats apart by value doesn't work: with the
+vehicle parked, the same X/Y/Z a few times in a row is normal at 4.35 mG a
+digit. If the sensor doesn't answer at all, we try again after MAG_RETRY.
+
+*/
+bool SensorControl::readMag() {
+	unsigned long now = micros();
+	if (_mag_wait != 0 && now - _mag_read_us < _mag_wait) {
+		return false;
+	}
+	_mag_read_us = now;
 
-	Vector vec = mag.readNormalize();
+	int16_t raw[3];
+	if (!mag.readBurst(raw[0], raw[1], raw[2])) {
+		_mag_wait = MAG_RETRY;
+		return false;
+	}
+	_mag_wait = MAG_PERIOD;
 
-	array[0] = vec.XAxis;
-	array[1] = vec.YAxis;
-	array[2] = vec.ZAxis;
+	int field[3];
+	for (int i = 0; i < 3; ++i) {
+		field[i] = ((long) raw[i] * _mag_q8) >> 8;
+	}
 
-	// Make sure to add magnitude to history
-	float magtd = magtd3(array[0], array[1], array[2]);
-	// Backwards shifting for-loop (leave first element)
-	for (int i = 3; i > 0 ; --i) {
-		_mag_history[i] = _mag_history[i - 1];
+	// Apply the calibration (hard iron, then soft iron)
+	_mag_cache.valid = true;
+	for (int i = 0; i < 3; ++i) {
+		_mag_raw[i] = field[i];
+		_mag_cache.valid = _mag_cache.valid && abs(field[i]) <= MAG_MAX_AXIS;
+		field[i] = ((long) (field[i] - _mag_cal.offset[i]) * _mag_cal.scale[i]) >> 8;
 	}
-	_mag_history[0] = magtd;
+	_mag_cache.s_time = millis();
+	_mag_cache.x = field[0];
+	_mag_cache.y = field[1];
+	_mag_cache.z = field[2];
+	_mag_sq = (long) field[0] * field[0] + (long) field[1] * field[1] + (long) field[2] * field[2];
+
+	_mag_strength = isqrt(_mag_sq);
+	trackMagBaseline();
+	return true;
+}
+
+// Modifies an x,y,z array of ints with field components
+void SensorControl::getMagComponents(Array<float> array) {
+	readMag();
+	array[0] = _mag_cache.x;
+	array[1] = _mag_cache.y;
+	array[2] = _mag_cache.z;
 } 
 
 // Returns xy plane angle of displacement
 int SensorControl::getMagBearing() {
-	Vector vec = mag.readNormalize();
+	readMag();
 
 	// Find angle in the Q1 section
 	// NOTE: We're using ZAxis because the sensor is mounted vertically
-	int angle = atan2(vec.ZAxis, vec.XAxis) * 180.0/PI + R_CORRECTION;
+	int angle = iatan2(_mag_cache.z, _mag_cache.x) + R_CORRECTION;
 
 	return angle;
 } 
 
+// For following the bearing as it changes (e.g. DriveControl's turn feedback),
+// where a reading that's already been used (or a maxed out one) is no help
+bool SensorControl::pollMagBearing(float & bearing) {
+	if (!readMag() || !_mag_cache.valid) {
+		return false;
+	}
+	bearing = iatan2(_mag_cache.z, _mag_cache.x) + R_CORRECTION;
+	return true;
+}
+
 // Returns angle of tile from horizon (negative if towards the ground)
 int SensorControl::getMagElevation() {
-	Vector vec = mag.readNormalize();
+	readMag();
 
-	return atan2(vec.YAxis, vec.XAxis) * 180/PI;
+	return iatan2(_mag_cache.y, _mag_cache.x);
 }
 
 // Returns the strength (magnitude) of the magnetic field
-float SensorControl::getMagStrength() {
-	Array<float> comps = Array<float>(3);
-	getMagComponents(comps);
-	return _mag_history[0];
-} 
-
-// Returns a value between 0 and 1 based on how much the reading has changed in recent times
-float SensorControl::deltaMagScore(int interval = 100) {
-	// Break variables into a mathable form (for readability);
-	float a = _mag_history[0], b = _mag_history[1], c = _mag_history[2];
-	float avg = (a + b + c) / 3;
-	float std_dev = sqrt((square(a-avg) + square(b-avg) + square(c-avg))/3);
-	return constrain(std_dev / 50, 0, 1); // "Normalized" standard deviation
-} 
+int SensorControl::getMagStrength() {
+	readMag();
+	return _mag_strength;
+}
 
 // True if none of the axial components are maxed out
 bool SensorControl::isMagValid() {
-	Array<float> comps = Array<float>(3);
-	getMagComponents(comps);
+	readMag();
+	return _mag_cache.valid;
+}
+
+// True if the magnitude of the signal is far enough from background magnetic field.
+// Same as |strength - background| > MAG_THRESHOLD, but squared.
+bool SensorControl::isMagInRange() {
+	readMag();
+	return _mag_sq > _mag_high_sq || _mag_sq < _mag_low_sq;
+}
+
+// Returns a value between 0 and 1 based on how much the reading has changed in the
+// last interval ms (the standard deviation, where 50 mG or more counts as 1).
+// It's worked out from the ring, so the anomaly window isn't touched.
+float SensorControl::deltaMagScore(int interval) {
+	readMag();
+	return constrain(_mag_stats.getDeviation(max(interval, 0)) / (50.0 * 16), 0, 1); // "Normalized" standard deviation
+}
+
+/*
+
+Anomaly detection
+
+The field the sensor sees while driving around drifts (the motors, steel in
+the floor and so on), so rather than comparing against a fixed background,
+we track it. The background follows the field strength slowly (an
+exponential average with a time constant of _baseline_tau), and so does the
+usual amount of noise. A target is something that moves the average over the
+stats window well away from the background: further than MAG_ANOMALY_K times
+the usual noise, and at least MAG_ANOMALY_MIN. While that's happening, the
+tracker holds still, so a target doesn't become part of the background. It
+only holds still for MAG_FREEZE_TIME though: a step that's still there after
+that (the motors drawing more, a different floor, steel nearby) is taken as
+the new background, rather than an anomaly that never ends.
+
+This runs with every reading, so it's all in integers (fixed point, with 8
+fractional bits), like the rest of the mag pipeline.
+
+*/
+
+bool SensorControl::isMagAnomaly() {
+	readMag();
+	return magAnomaly();
+}
+
+bool SensorControl::magAnomaly() const {
+	if (!_baseline_set || _mag_stats.count() == 0) {
+		return false;
+	}
+	long limit = max(MAG_ANOMALY_K * _noise_q8, (long) MAG_ANOMALY_MIN << 8);
+	return labs(((long) _mag_stats.getMean() << 8) - _baseline_q8) > limit;
+}
+
+int SensorControl::getMagBaseline() const {
+	return _baseline_set ? (_baseline_q8 + 128) >> 8 : _mag_cal.background;
+}
+
+void SensorControl::setMagWindow(unsigned int interval) {
+	_mag_stats.setWindow(interval);
+}
+
+void SensorControl::setMagBaselineTime(unsigned int time_constant) {
+	_baseline_tau = max(time_constant, 1);
+}
+
+void SensorControl::resetMagBaseline() {
+	_baseline_set = false;
+	_noise_q8 = (long) MAG_ANOMALY_MIN * 256 / MAG_ANOMALY_K;
+}
+
+// Moves value towards target like an exponential average with time constant
+// tau, dt after the last step (both in ms). Both times are shrunk together
+// (only their ratio matters) so the product can't overflow.
+static long follow(long value, long target, unsigned long dt, unsigned long tau) {
+	while (dt > 1023) {
+		dt >>= 1;
+		tau >>= 1;
+	}
+	return value + (target - value) * (long) dt / (long) (tau + dt);
+}
+
+void SensorControl::trackMagBaseline() {
+	unsigned long now = _mag_cache.s_time;
+	_mag_stats.push(now, _mag_strength);
+	long strength = (long) min(_mag_strength, MAG_STATS_MAX) << 8;
+
+	if (!_baseline_set) {
+		_baseline_q8 = strength;
+		_baseline_time = now;
+		_baseline_set = true;
+		_baseline_frozen = false;
+		return;
+	}
+
+	unsigned long dt = now - _baseline_time;
+	_baseline_time = now;
+	if (!magAnomaly()) {
+		_baseline_frozen = false;
+	} else if (!_baseline_frozen) {
+		_baseline_frozen = true;
+		_freeze_time = now;
+		return;
+	} else if (now - _freeze_time < MAG_FREEZE_TIME) {
+		return;
+	}
+	_baseline_q8 = follow(_baseline_q8, strength, dt, _baseline_tau);
+	_noise_q8 = follow(_noise_q8, (long) _mag_stats.getDeviation() << 4, dt, _baseline_tau);
+}
+
+void MagStats::push(unsigned long s_time, int value) {
+	value = constrain(value, 0, MAG_STATS_MAX);
+	if (_count == MAG_STATS_SIZE && _n == MAG_STATS_SIZE) {
+		// The oldest reading is about to be overwritten, so it leaves the window too
+		int oldest = _value[(_head + 1) % MAG_STATS_SIZE];
+		_sum -= oldest;
+		_sum_sq -= (long) oldest * oldest;
+		_n--;
+	}
+	_head = (_head + 1) % MAG_STATS_SIZE;
+	_time[_head] = s_time;
+	_value[_head] = value;
+	if (_count < MAG_STATS_SIZE) {
+		_count++;
+	}
+	_sum += value;
+	_sum_sq += (long) value * value;
+	_n++;
+	trim(s_time);
+}
+
+void MagStats::setWindow(unsigned int window) {
+	_window = window;
+	rebuild();
+}
+
+int MagStats::getMean() const {
+	return (_n > 0) ? (_sum + _n / 2) / _n : 0;
+}
+
+unsigned int MagStats::getDeviation() const {
+	return deviation(_sum, _sum_sq, _n);
+}
+
+// One pass over the ring, newest first, so it costs up to MAG_STATS_SIZE
+// steps. Readings older than the ring can't be counted.
+unsigned int MagStats::getDeviation(unsigned int window) const {
+	long sum = 0;
+	unsigned long sum_sq = 0;
+	byte n = 0;
+	unsigned int now = _time[_head];
+	for (byte k = 0; k < _count; ++k) {
+		byte i = (_head + MAG_STATS_SIZE - k) % MAG_STATS_SIZE;
+		if ((unsigned int) (now - _time[i]) > window) {
+			break;
+		}
+		sum += _value[i];
+		sum_sq += (long) _value[i] * _value[i];
+		n++;
+	}
+	return deviation(sum, sum_sq, n);
+}
+
+void MagStats::reset() {
+	_count = 0;
+	_n = 0;
+	_sum = 0;
+	_sum_sq = 0;
+}
+
+void MagStats::trim(unsigned int now) {
+	while (_n > 0) {
+		byte oldest = (_head + MAG_STATS_SIZE - (_n - 1)) % MAG_STATS_SIZE;
+		if ((unsigned int) (now - _time[oldest]) <= _window) {
+			break;
+		}
+		_sum -= _value[oldest];
+		_sum_sq -= (long) _value[oldest] * _value[oldest];
+		_n--;
+	}
+}
+
+void MagStats::rebuild() {
+	_n = 0;
+	_sum = 0;
+	_sum_sq = 0;
+	if (_count == 0) {
+		return;
+	}
+	// Add readings from newest to oldest, as long as they're in the window
+	unsigned int now = _time[_head];
+	for (byte k = 0; k < _count; ++k) {
+		byte i = (_head + MAG_STATS_SIZE - k) % MAG_STATS_SIZE;
+		if ((unsigned int) (now - _time[i]) > _window) {
+			break;
+		}
+		_sum += _value[i];
+		_sum_sq += (long) _value[i] * _value[i];
+		_n++;
+	}
+}
+
+// n * sum_sq - sum^2 would overflow a long, so the spread is taken around the
+// rounded mean m instead:
+// sum of (x - m)^2 = sum_sq - m * (sum + r), where r = sum - n * m.
+// That's n times the variance around m, which is off from the real variance
+// by (r / n)^2. With readings up to MAG_STATS_MAX, none of it overflows.
+unsigned int MagStats::deviation(long sum, unsigned long sum_sq, byte n) {
+	if (n < 2) {
+		return 0;
+	}
+	long m = (sum + n / 2) / n;
+	long r = sum - n * m;
+	unsigned long spread = sum_sq - m * (sum + r);
+	unsigned long var_q4 = (spread * 16 + n / 2) / n; // Variance, times 16
+	var_q4 -= min(var_q4, (unsigned long) (16 * r * r) / (n * n));
+	return isqrt(var_q4 * 16); // Square root of the variance times 256
+}
+
+/*
+
+Magnetic sensor calibration
+
+The vehicle (motors and all) has a field of its own, which turns with the
+sensor and shifts every reading (hard iron). Nearby steel also squashes the
+field more along some axes than others (soft iron). Spinning the vehicle on
+the spot sweeps the sensor through the Earth's field in every direction, and
+MagCalibrator fits the shape those readings make. The result is applied to
+every reading, and kept in EEPROM so it only needs doing once.
+
+The caller owns the MagCalibrator (e.g. a local in the function doing the
+spin), so its 200 or so bytes are only taken while calibrating, without
+going through the heap.
+
+*/
+
+void SensorControl::beginMagCalibration(MagCalibrator & calibrator) {
+	calibrator = MagCalibrator();
+	_calibrator = &calibrator;
+}
+
+bool SensorControl::sampleMagCalibration() {
+	if (_calibrator == NULL || !readMag()) {
+		return false;
+	}
+	_calibrator->add(_mag_raw[0], _mag_raw[1], _mag_raw[2]);
+	return true;
+}
+
+bool SensorControl::endMagCalibration(bool save) {
+	if (_calibrator == NULL) {
+		return false;
+	}
+	MagCalibration cal;
+	bool solved = _calibrator->solve(cal);
+	_calibrator = NULL;
+
+	if (!solved) {
+		if (F_DEBUG && Serial) Serial.println("Mag calibration needs more (or wider) readings");
+		return false;
+	}
+	applyMagCalibration(cal);
+	if (save) {
+		saveMagCalibration();
+	}
+	return true;
+}
+
+bool SensorControl::loadMagCalibration() {
+	MagCalibration cal;
+	if (!loadBlock(EEPROM_MAG_CAL, MAG_CAL_VERSION, &cal, sizeof(cal))) {
+		return false;
+	}
+	applyMagCalibration(cal);
+	return true;
+}
+
+void SensorControl::saveMagCalibration() {
+	saveBlock(EEPROM_MAG_CAL, MAG_CAL_VERSION, &_mag_cal, sizeof(_mag_cal));
+}
+
+void SensorControl::clearMagCalibration() {
+	MagCalibration cal;
+	applyMagCalibration(cal);
+}
+
+int SensorControl::getMagBackground() const {
+	return _mag_cal.background;
+}
+
+void SensorControl::applyMagCalibration(const MagCalibration & cal) {
+	_mag_cal = cal;
+	long high = (long) cal.background + MAG_THRESHOLD;
+	long low = max((long) cal.background - MAG_THRESHOLD, 0L);
+	_mag_high_sq = high * high;
+	_mag_low_sq = low * low;
+	_mag_wait = 0; // Next read is taken fresh, with the new corrections
+}
+
+void MagCalibrator::add(int x, int y, int z) {
+	if (_count == 0) {
+		for (int i = 0; i < 6; ++i) {
+			_atb[i] = 0;
+			for (int j = 0; j < 6; ++j) {
+				_ata[i][j] = 0;
+			}
+		}
+		for (int i = 0; i < 3; ++i) {
+			_sum[i] = 0;
+		}
+		_low[0] = _high[0] = x;
+		_low[1] = _high[1] = y;
+		_low[2] = _high[2] = z;
+	}
+
+	int field[3] = {x, y, z};
+	float terms[6];
 	for (int i = 0; i < 3; ++i) {
-		if (abs(comps[i]) > (2000)) {
-			return false;
+		_low[i] = min(_low[i], field[i]);
+		_high[i] = max(_high[i], field[i]);
+		_sum[i] += field[i];
+		float g = field[i] / 1000.0; // Work in gauss, to keep the sums a sensible size
+		terms[i] = g * g;
+		terms[i + 3] = g;
+	}
+	for (int i = 0; i < 6; ++i) {
+		_atb[i] += terms[i];
+		for (int j = i; j < 6; ++j) {
+			_ata[i][j] += terms[i] * terms[j];
+		}
+	}
+	_count++;
+}
+
+bool MagCalibrator::solve(MagCalibration & cal) const {
+	// Only fit the axes that actually moved
+	byte axes[3];
+	byte n = 0;
+	for (byte i = 0; i < 3; ++i) {
+		if (_high[i] - _low[i] >= CAL_MIN_SPREAD) {
+			axes[n++] = i;
+		}
+	}
+	if (_count < CAL_MIN_SAMPLES || n < 2) {
+		return false;
+	}
+
+	// Pick the rows/columns of the fitted axes out of the normal equations,
+	// then solve them (Gaussian elimination with partial pivoting)
+	byte size = 2 * n;
+	float m[6][7];
+	for (byte r = 0; r < size; ++r) {
+		byte tr = (r < n) ? axes[r] : axes[r - n] + 3;
+		for (byte c = 0; c < size; ++c) {
+			byte tc = (c < n) ? axes[c] : axes[c - n] + 3;
+			m[r][c] = (tr <= tc) ? _ata[tr][tc] : _ata[tc][tr];
+		}
+		m[r][size] = _atb[tr];
+	}
+	bool fitted = true;
+	for (byte col = 0; col < size && fitted; ++col) {
+		byte pivot = col;
+		for (byte r = col + 1; r < size; ++r) {
+			if (abs(m[r][col]) > abs(m[pivot][col])) {
+				pivot = r;
+			}
+		}
+		if (abs(m[pivot][col]) < 1E-6) {
+			fitted = false;
+			break;
+		}
+		for (byte c = 0; c <= size; ++c) {
+			float t = m[col][c];
+			m[col][c] = m[pivot][c];
+			m[pivot][c] = t;
+		}
+		for (byte r = 0; r < size; ++r) {
+			if (r != col) {
+				float f = m[r][col] / m[col][col];
+				for (byte c = col; c <= size; ++c) {
+					m[r][c] -= f * m[col][c];
+				}
+			}
+		}
+	}
+
+	// Turn the fitted coefficients into a centre and radius for each axis
+	float centre[3], radius[3];
+	if (fitted) {
+		float g = 1;
+		for (byte k = 0; k < n; ++k) {
+			float a = m[k][size] / m[k][k];
+			float d = m[k + n][size] / m[k + n][k + n];
+			if (a <= 0) {
+				fitted = false;
+				break;
+			}
+			centre[k] = -d / (2 * a);
+			g += d * d / (4 * a);
+		}
+		for (byte k = 0; k < n && fitted; ++k) {
+			float a = m[k][size] / m[k][k];
+			radius[k] = sqrt(g / a) * 1000; // Back to milligauss
+			centre[k] *= 1000;
+		}
+	}
+	if (!fitted) {
+		if (F_DEBUG && Serial) Serial.println("Mag fit failed, using min/max instead");
+		for (byte k = 0; k < n; ++k) {
+			centre[k] = (_high[axes[k]] + _low[axes[k]]) / 2.0;
+			radius[k] = (_high[axes[k]] - _low[axes[k]]) / 2.0;
 		}
 	}
+
+	float mean_radius = 0;
+	for (byte k = 0; k < n; ++k) {
+		mean_radius += radius[k] / n;
+	}
+
+	// Axes that weren't fitted are left alone, but still count towards the
+	// strength of the background field
+	float background = mean_radius * mean_radius;
+	for (byte i = 0; i < 3; ++i) {
+		cal.offset[i] = 0;
+		cal.scale[i] = 256;
+		if (_high[i] - _low[i] < CAL_MIN_SPREAD) {
+			float average = (float) _sum[i] / _count;
+			background += average * average;
+		}
+	}
+	for (byte k = 0; k < n; ++k) {
+		cal.offset[axes[k]] = round(centre[k]);
+		cal.scale[axes[k]] = round(256 * mean_radius / radius[k]);
+	}
+	cal.background = round(sqrt(background));
 	return true;
-} 
+}
 
-// True if the magnitude of the signal is far enough from background magnetic field
-bool SensorControl::isMagInRange() {
-	return abs(getMagStrength() - BACKGROUND_FIELD) > MAG_THRESHOLD;
-} 
+/*
+
+Magnetic sweep
+
+Rather than stopping and checking the mag every so often, turn on the spot
+and let every reading go towards a picture of the field all the way around.
+The caller passes in the heading (e.g. from DriveControl::getHeading()),
+since SensorControl doesn't know how the vehicle is moving. Like the
+calibration, the caller owns the MagSweep.
+
+*/
+
+void SensorControl::beginMagSweep(MagSweep & sweep) {
+	sweep = MagSweep();
+	_sweep = &sweep;
+}
+
+bool SensorControl::sampleMagSweep(float heading) {
+	if (_sweep == NULL || !readMag()) {
+		return false;
+	}
+	_sweep->add(heading, _mag_cache.x, _mag_cache.y, _mag_cache.z);
+	return true;
+}
+
+bool SensorControl::endMagSweep(MagTarget & target) {
+	if (_sweep == NULL) {
+		return false;
+	}
+	bool found = _sweep->solve(target);
+	_sweep = NULL;
+	return found;
+}
+
+void MagSweep::add(float heading, int x, int y, int z) {
+	float wrapped = fmod(heading, 360);
+	if (wrapped < 0) {
+		wrapped += 360;
+	}
+	int bin = (int) (wrapped * SWEEP_BINS / 360) % SWEEP_BINS;
+	if (_count[bin] == 255) {
+		return; // Plenty in this bin already
+	}
+	// Summed, and only divided in solve(), so small changes aren't rounded away
+	_count[bin]++;
+	_sum[bin][0] += x;
+	_sum[bin][1] += y;
+	_sum[bin][2] += z;
+	_total++;
+}
+
+bool MagSweep::solve(MagTarget & target) const {
+	int bins = 0;
+	for (int i = 0; i < SWEEP_BINS; ++i) {
+		bins += _count[i] > 0;
+	}
+	if (bins < SWEEP_MIN_BINS) {
+		return false;
+	}
+
+	// Work out which way the sensor turns, then what the Earth's field is
+	float earth[3];
+	int sense = (spread(1, earth, false) <= spread(-1, earth, false)) ? 1 : -1;
+	spread(sense, earth, true);
+
+	// Find the bin that sticks out the most from the Earth's field
+	float anomaly[3] = {-1, -1, -1}; // The best bin, and the ones either side of it
+	int best = -1;
+	for (int i = 0; i < SWEEP_BINS; ++i) {
+		if (_count[i] == 0) {
+			continue;
+		}
+		float a = offEarth(i, sense, earth);
+		if (a > anomaly[1]) {
+			anomaly[1] = a;
+			best = i;
+		}
+	}
+	if (anomaly[1] < MAG_ANOMALY_MIN) {
+		return false;
+	}
+	for (int k = 0; k < 3; k += 2) {
+		int bin = (best + SWEEP_BINS + k - 1) % SWEEP_BINS;
+		if (_count[bin] > 0) {
+			anomaly[k] = offEarth(bin, sense, earth);
+		}
+	}
+
+	// Fit a parabola through the peak and its neighbours (if we have them)
+	float peak = anomaly[1];
+	float shift = 0;
+	float curve = anomaly[0] - 2 * anomaly[1] + anomaly[2];
+	if (anomaly[0] >= 0 && anomaly[2] >= 0 && curve < 0) {
+		shift = constrain(0.5 * (anomaly[0] - anomaly[2]) / curve, -0.5, 0.5);
+		peak -= 0.25 * (anomaly[0] - anomaly[2]) * shift;
+	}
+
+	float bearing = (best + 0.5 + shift) * 360 / SWEEP_BINS;
+	if (bearing > 180) {
+		bearing -= 360;
+	}
+	target.bearing = round(bearing);
+	target.strength = round(peak);
+	target.range = round(cbrt(MAG_DIPOLE_K / peak));
+	return true;
+}
+
+// The horizontal axes of the sensor are x and z (it's mounted vertically)
+void MagSweep::world(int bin, int sense, float out[3]) const {
+	float heading = (bin + 0.5) * 2 * PI / SWEEP_BINS;
+	float c = cos(heading), s = sin(heading) * sense;
+	float mean[3];
+	for (int i = 0; i < 3; ++i) {
+		mean[i] = (float) _sum[bin][i] / _count[bin];
+	}
+	out[0] = mean[0] * c - mean[2] * s;
+	out[1] = mean[1];
+	out[2] = mean[0] * s + mean[2] * c;
+}
+
+float MagSweep::offEarth(int bin, int sense, const float earth[3]) const {
+	float w[3];
+	world(bin, sense, w);
+	return sqrt(square(w[0] - earth[0]) + square(w[1] - earth[1]) + square(w[2] - earth[2]));
+}
+
+// With trim, bins further from earth than usual are left out of the new
+// average (so earth has to be filled in already)
+float MagSweep::spread(int sense, float earth[3], bool trim) const {
+	float limit = 0;
+	if (trim) {
+		spread(sense, earth, false);
+		int n = 0;
+		for (int i = 0; i < SWEEP_BINS; ++i) {
+			if (_count[i] > 0) {
+				limit += offEarth(i, sense, earth);
+				n++;
+			}
+		}
+		limit /= n;
+	}
+
+	float sum[3] = {0, 0, 0};
+	float sum_sq = 0;
+	int n = 0;
+	for (int i = 0; i < SWEEP_BINS; ++i) {
+		if (_count[i] == 0) {
+			continue;
+		}
+		if (trim && offEarth(i, sense, earth) > limit) {
+			continue;
+		}
+		float w[3];
+		world(i, sense, w);
+		for (int j = 0; j < 3; ++j) {
+			sum[j] += w[j];
+			sum_sq += w[j] * w[j];
+		}
+		n++;
+	}
+	for (int j = 0; j < 3; ++j) {
+		earth[j] = sum[j] / n;
+		sum_sq -= n * earth[j] * earth[j];
+	}
+	return sum_sq / n;
+}
@@ -27,16 +27,58 @@ License: GPLv3
 #include <Array.h>
 #include <Math.h>
 #include <Wire.h>
+#include <ARDVARC_UTIL.h>
+#include "SonarEngine.h"
 
 
 #define MAG_ADDR 0x1E		  // Address of the HMC5883L
 #define BACKGROUND_FIELD 2500 // milligauss - used to determine if magnetic field is of target
 #define MAG_THRESHOLD 1500    // Number of milligauss deviation before considered a real signal.
+#define MAG_MAX_AXIS 2000     // milligauss - an axis reading beyond this is treated as maxed out
+#define MAG_STATS_SIZE 32     // Readings kept for the streaming stats (about 420 ms worth at 75 Hz)
+#define MAG_WINDOW 100        // Default time window (ms) for the streaming stats
+#define MAG_BASELINE_TIME 2000 // Default time (ms) the background tracker takes to follow a change
+#define MAG_FREEZE_TIME 10000 // Longest time (ms) the background tracker holds still for an anomaly, before taking it as the new background
+#define MAG_STATS_MAX 4095    // milligauss - strengths are capped at this for the stats and tracker, so their integer sums can't overflow
+#define MAG_ANOMALY_K 4       // How many times the usual noise the field has to move to count as a target
+#define MAG_ANOMALY_MIN 100   // milligauss - and it has to move at least this much
+#define SWEEP_BINS 36         // Headings in a sweep are grouped into bins this many to a full turn
+#define SWEEP_MIN_BINS 9      // A sweep has to cover this many bins (a quarter turn) to be worked out
+#define MAG_DIPOLE_K 1000000000.0 // mG * mm^3 - a target's field is about this over the distance cubed (8000 mG at 50 mm)
+#define MAG_CAL_VERSION 1     // Bump this if MagCalibration changes, so old EEPROM data is ignored
+#define CAL_MIN_SAMPLES 50    // Fewest readings a calibration can be fitted from
+#define CAL_MIN_SPREAD 200    // milligauss - an axis has to swing this much during calibration to be corrected
+// Squared limits of the field strength for isMagInRange, before calibration (so we don't need a square root)
+#define MAG_HIGH_SQ ((long) (BACKGROUND_FIELD + MAG_THRESHOLD) * (BACKGROUND_FIELD + MAG_THRESHOLD))
+#define MAG_LOW_SQ ((long) (BACKGROUND_FIELD - MAG_THRESHOLD) * (BACKGROUND_FIELD - MAG_THRESHOLD))
+#define MAG_PERIOD 13333      // Time (us) between new readings from the magnetic sensor (it runs at 75 Hz)
+#define MAG_RETRY 1000        // Time (us) to wait before asking again if the sensor didn't answer
 
 #define R_CORRECTION 90     // Angle added to the bearing to correct for negatives
 #define PING_COUNT 2		// Number of pings to average out for our final value
-#define PING_INTERVAL 20    // Minimum amount of time to wait (ms) in-between pings.
 #define MAX_SONAR_DIST 3000 // Maximum distance for sensing (in mm).
+#define ARENA_MAX_DIST 3600 // Longest straight line in the arena (in mm). Nothing can echo from further away.
+#define ADAPT_MARGIN 250 // How much further (mm) than its last reading a sonar listens for
+#define ADAPT_MIN_DIST 300 // Shortest listening range (mm) a sonar is ever given
+#define SNAPSHOT_STAGGER 600 // Time (us) between triggers of sonars in flight together (see fillDistSnapshot)
+#define SNAPSHOT_XTALK 150 // Echoes ending closer together (us) than this are treated as crosstalk
+#define FLOOR_EVENTS 8 // Floor changes the pin change interrupt can hold until they're looked at
+#define FLOOR_DEBOUNCE 5 // Time (ms) the floor has to stay the same for a change to count
+#define FLOOR_START 1 // Floor types (see getFloorType)
+#define FLOOR_MAIN 2
+#define FLOOR_RAMP 3
+#define FLOOR_UPPER 4
+#define FLOOR_CLASSES 4 // Floor classes analog mode starts with (darkest first)
+#define FLOOR_BOUNDS {250, 450, 700} // Levels between those classes (measure yours with tests/floor_levels)
+#define FLOOR_TYPES {FLOOR_START, FLOOR_RAMP, FLOOR_MAIN, FLOOR_UPPER} // Floor type of each class
+
+// Sonar filter constants
+#define FILTER_MAX_WINDOW 9 // Largest window (in pings) the sonar filters can keep
+#define FILTER_WINDOW 5 // Default window for the sonar filters (1 turns filtering off)
+#define FILTER_HAMPEL_K 3.0 // Default Hampel threshold (in scaled MADs). 0 makes it a plain median.
+#define FILTER_ZERO_LIMIT 3 // Number of no-echo pings in a row before we believe them
+#define FILTER_MIN_MAD 10 // Smallest spread (mm) the Hampel test uses, so a flat window doesn't reject everything
+#define FILTER_MAX_AGE 500 // A filter that hasn't had a ping for this long (ms) starts afresh (the old pings are of a different scene)
 
 // Blipping constants
 #define BLIP_CAP 2000 // distances are capped at this to stop noise from being interpreted as a blip
@@ -44,6 +86,270 @@ License: GPLv3
 #define BLIP_THRESHOLD 50        // Difference in reading that counts as a falling edge on the blip
 #define BLIP_RETURN_THRESHOLD 50 // Difference from expected reading (from falling edge) that counts as a rising edge
 
+// Wall fitting constants (see WallFit)
+#define WALL_WINDOW 12 // Number of side pings the wall fit looks at
+#define WALL_MIN_STEP 25 // Distance (mm) to travel between pings added to the wall fit
+#define WALL_MIN_SPAN 100 // Distance (mm) the window has to cover before the fit is trusted
+#define WALL_MAX_DIST 1500 // Side pings further than this (mm) are left out of the wall fit
+#define WALL_GATE 80 // Pings further than this (mm) from the fitted wall are treated as gaps or obstacles
+#define WALL_GATE_LIMIT 3 // Number of those in a row before we decide the wall itself has moved
+
+// The latest reading from a single sonar, as kept by the background sonar engine
+struct SonarReading {
+	unsigned long s_time = 0; // Time value in ms when the reading was taken
+	int dist = 0; // Distance in mm (0 if there was no echo)
+	bool valid = false; // False until the sonar has been pinged at least once
+};
+
+// The latest reading from the magnetic sensor
+struct MagReading {
+	unsigned long s_time = 0; // Time value in ms when the reading was taken
+	int x = 0, y = 0, z = 0; // Field components in milligauss
+	bool valid = false; // False until the sensor has been read, or if an axis was maxed out
+};
+
+// Corrections for the magnetic sensor, worked out by the calibration
+struct MagCalibration {
+	int offset[3] = {0, 0, 0}; // Hard iron: milligauss taken off each axis (x, y, z)
+	int scale[3] = {256, 256, 256}; // Soft iron: what each axis is then multiplied by (times 256)
+	int background = BACKGROUND_FIELD; // Strength (mG) of the corrected field with no target around
+};
+
+// Where a sweep thinks the strongest target is
+struct MagTarget {
+	int bearing = 0; // Degrees from the heading the sweep started at (right is positive), -180 to 180
+	int range = 0; // Rough distance (mm) from the sensor, going by how strong it is
+	int strength = 0; // How far (mG) the field there is from the background
+};
+
+// The latest reading from the line tracker
+struct FloorReading {
+	unsigned long s_time = 0; // Time value in ms when the reading was taken
+	bool main = false; // True if the floor is light (same as isFloorMain())
+	short type = 0; // Same as getFloorType()
+	bool valid = false; // False until the line tracker has been read
+};
+
+// Every sensor reading, with the time each one was taken (see fillSnapshot)
+struct SensorSnapshot {
+	SonarReading sonars[SONAR_COUNT]; // Indexed by SONAR_<SIDE>
+	MagReading mag;
+	FloorReading floor;
+};
+
+struct PingCapture {
+	unsigned long s_time = 0;
+	unsigned short dist = 0;
+};
+
+/*
+
+Keeps the last BLIP_HIST pings of a sonar in a ring buffer, and looks for
+blips as the pings come in. A blip is a falling edge (something passes in
+front of the sonar) followed by a rising edge back to where the reading was
+before. Every push and every query takes the same (short) time, no matter how
+big the history is.
+
+*/
+class BlipStore
+{
+public:
+	BlipStore() {};
+	void push(int dist, unsigned long s_time); // Adds a ping to the history and updates the edge detector
+	bool getBlip(PingCapture & blip) const; // Fills in the first ping of the latest blip. False if there isn't one.
+	int count() const { return _count; }; // Number of pings in the history
+	PingCapture getPing(int age) const; // Returns a ping from history (0 is the most recent)
+private:
+	PingCapture _hist[BLIP_HIST]; // Ring buffer of pings
+	byte _head = 0; // Index of the most recent ping
+	byte _count = 0;
+	unsigned int _seq = 0; // Counts pushes. Used to age edges out of the history.
+
+	// Edge detector state
+	bool _in_blip = false; // True between a falling edge and its rising edge
+	unsigned short _expected; // Reading from before the falling edge (what we expect to return to)
+	PingCapture _edge; // First ping of the blip in progress
+	unsigned int _edge_seq;
+	bool _has_blip = false;
+	PingCapture _blip; // First ping of the last completed blip
+	unsigned int _blip_seq;
+};
+
+/*
+
+Cleans up the readings of one sonar, one ping at a time. Keeps the last few
+pings (the window) both in the order they came in and sorted, so the median
+is always on hand. In Hampel mode, a ping is only replaced by the median if
+it's too far from it (more than k scaled median absolute deviations),
+otherwise it passes straight through. In median mode, the median is always
+returned.
+
+Pings with no echo are ignored (the last value is held) until there have been
+`zero_limit` of them in a row. After that we believe there's nothing there,
+return 0 and start the window afresh.
+
+The window also starts afresh if the last ping was more than FILTER_MAX_AGE
+ago. After a pause (or a turn without reading), the old pings are of a
+different scene, and a real change would otherwise look like an outlier.
+
+*/
+class SonarFilter
+{
+public:
+	SonarFilter() {};
+	void setup(byte window, float hampel_k = FILTER_HAMPEL_K, byte zero_limit = FILTER_ZERO_LIMIT);
+	int push(int dist, unsigned long now); // Adds a raw reading (mm) taken at now (ms) and returns the filtered reading
+	int get() const { return _value; }; // Returns the last filtered reading
+	byte getWindow() const { return _window; };
+	void reset(); // Forgets all pings
+private:
+	int _ring[FILTER_MAX_WINDOW]; // Pings in the order they came in
+	int _sorted[FILTER_MAX_WINDOW]; // The same pings, smallest first
+	byte _head = 0; // Index of the oldest ping in _ring
+	byte _count = 0;
+	byte _window = FILTER_WINDOW;
+	byte _k10 = FILTER_HAMPEL_K * 10; // Hampel threshold times 10 (0 for median mode)
+	byte _zero_limit = FILTER_ZERO_LIMIT;
+	byte _zeros = 0; // No-echo pings in a row
+	int _value = 0;
+	unsigned long _last_time = 0; // When the last ping came in (ms)
+};
+
+/*
+
+Fits a straight line to the pings of a side sonar against the distance the
+vehicle has travelled (a rolling least-squares fit). The slope of that line
+is how fast we're closing in on the wall, which gives the angle between the
+vehicle and the wall. The sums are updated as pings come in and drop out of
+the window, so the fit is always up to date.
+
+Travelled distances are kept relative to the oldest ping in the window, and
+the sums are rebuilt from scratch every so often, so float rounding doesn't
+creep in.
+
+*/
+class WallFit
+{
+public:
+	WallFit() {};
+	void push(float s, int dist); // Adds a ping (mm) taken after travelling s (mm)
+	void reset(); // Forgets all pings
+	bool isValid() const; // True if there are enough pings (spread out enough) to trust the fit
+	float getSlope() const; // Change in distance per mm travelled
+	float getDistanceAt(float s) const; // Where the fitted wall is (mm) after travelling s
+private:
+	float _s[WALL_WINDOW]; // Travelled distance of each ping, relative to _s0
+	int _d[WALL_WINDOW]; // Distance of each ping
+	byte _head = 0; // Index of the oldest ping
+	byte _count = 0;
+	byte _misses = 0; // Pings in a row that didn't fit the wall
+	byte _pushes = 0; // Pushes since the sums were last rebuilt
+	float _s0 = 0; // Travelled distance the window is measured from
+	float _sum_s = 0, _sum_d = 0, _sum_ss = 0, _sum_sd = 0;
+	void rebuild(); // Recomputes the sums (and _s0) from the window
+	void add(float s, int dist, int sign); // Adds (or with sign -1, removes) a ping from the sums
+};
+
+/*
+
+Works out a MagCalibration from readings taken while the vehicle spins. The
+readings should sit on an ellipsoid (a sphere stretched along the axes, and
+moved off the origin by the vehicle's own field). Fitting
+a x^2 + b y^2 + c z^2 + d x + e y + f z = 1 by least squares gives its centre
+(the hard iron offset) and its radius along each axis (the soft iron scale).
+
+A spin on the floor only turns the sensor around one axis, so an axis that
+doesn't swing by CAL_MIN_SPREAD is left out of the fit (and isn't corrected).
+If the fit doesn't work out, the middle and spread of each axis are used
+instead.
+
+*/
+class MagCalibrator
+{
+public:
+	MagCalibrator() {};
+	void add(int x, int y, int z); // Adds a reading (mG, uncorrected)
+	bool solve(MagCalibration & cal) const; // Fills in cal. False if there isn't enough to go on.
+	int count() const { return _count; };
+private:
+	float _ata[6][6]; // Normal equations of the fit (terms: x^2, y^2, z^2, x, y, z)
+	float _atb[6];
+	int _low[3], _high[3]; // Smallest and largest reading on each axis
+	long _sum[3]; // For the average of axes that aren't fitted
+	int _count = 0;
+};
+
+/*
+
+Collects readings while the vehicle turns on the spot, sorted by heading
+into SWEEP_BINS bins. Turning each bin's average back by its heading puts
+them all the same way around as the arena (the "world"). Seen like that,
+the Earth's field is the same in every bin, and a target's field is what
+sticks out: the sensor isn't in the middle of the vehicle, so it gets
+closer to a target when facing it. The bin that sticks out the most (fine
+tuned by fitting a parabola through it and its neighbours) gives the
+bearing, and how far it sticks out gives a rough range (a target's field
+drops off with the cube of the distance).
+
+Which way the horizontal axes turn depends on how the sensor is mounted,
+so both ways are tried, and the one that keeps the Earth's field steadiest
+is used. The Earth's field is the average of the bins, leaving out the ones
+that stick out more than usual.
+
+*/
+class MagSweep
+{
+public:
+	MagSweep() {};
+	void add(float heading, int x, int y, int z); // Adds a reading (mG) taken at a heading (degrees)
+	bool solve(MagTarget & target) const; // Fills in target. False if nothing stood out.
+	int count() const { return _total; };
+private:
+	long _sum[SWEEP_BINS][3] = {}; // Sum of the readings (mG) in each bin
+	byte _count[SWEEP_BINS] = {};
+	int _total = 0;
+	void world(int bin, int sense, float out[3]) const; // A bin's average, turned back by its heading
+	float offEarth(int bin, int sense, const float earth[3]) const; // How far (mG) a bin is from earth
+	float spread(int sense, float earth[3], bool trim) const; // Averages the bins into earth. Returns how much they vary.
+};
+
+/*
+
+Running mean and standard deviation of the field strength over the last
+`window` ms. Readings are added to integer sums (of the values and of their
+squares) as they come in and taken back out as they get too old, so each
+reading costs the same no matter how big the window is, and nothing is lost
+to rounding along the way. Values are capped at MAG_STATS_MAX, so the sums
+can't overflow. The last MAG_STATS_SIZE readings are kept in a ring (with 16
+bit timestamps, which is plenty for windows under a minute), so the window
+can be changed on the fly.
+
+*/
+class MagStats
+{
+public:
+	MagStats() {};
+	void push(unsigned long s_time, int value); // Adds a reading (and drops any that are now too old)
+	void setWindow(unsigned int window); // Changes the time window (ms)
+	unsigned int getWindow() const { return _window; };
+	byte count() const { return _n; }; // Readings in the window
+	int getMean() const; // Mean of the readings in the window (mG, rounded)
+	unsigned int getDeviation() const; // Standard deviation of the readings in the window, in sixteenths of a mG
+	unsigned int getDeviation(unsigned int window) const; // The same for a different window (ms), from the ring. Limited to the last MAG_STATS_SIZE readings.
+	void reset(); // Forgets all readings
+private:
+	unsigned int _time[MAG_STATS_SIZE]; // Low 16 bits of each reading's time value (ms)
+	int _value[MAG_STATS_SIZE];
+	byte _head = 0; // Index of the newest reading
+	byte _count = 0; // Readings in the ring
+	byte _n = 0; // Readings in the window (the newest _n in the ring)
+	unsigned int _window = MAG_WINDOW;
+	long _sum = 0; // Sum of the readings in the window
+	unsigned long _sum_sq = 0; // Sum of their squares
+	void trim(unsigned int now); // Drops readings that are older than the window
+	void rebuild(); // Recomputes the sums from the ring
+	static unsigned int deviation(long sum, unsigned long sum_sq, byte n); // Standard deviation (1/16 mG) of n readings from their sums
+};
 
 class SensorControl
 {
@@ -57,15 +363,37 @@ public:
 
 	// Ultrasonics
 	void fillDistArray(Array<int> array); // Mods a 4-element array of distance measurements (starting at front, clockwise).
+	bool fillDistSnapshot(Array<int> array); // As above, but pings two sonars at a time. False if it had to use fillDistArray.
 	int getFrontDistance(); // Returns the distance to the closest Front obstacle (in line of sight of sensor).
 	int getRightDistance(); // As above, for Right
 	int getRearDistance(); // As above, for Rear
 	int getLeftDistance(); // As above, for Left
 	int getBehindDistance() { return getRearDistance(); }; // Alias for getRearDistance
 
+	// Background sonar engine (non-blocking)
+	bool startSonars(); // Starts pinging the sonars round-robin in the background. False if the pins can't be used.
+	void stopSonars(); // Goes back to blocking pings in the get<Side>Distance() functions
+	bool isSonarsRunning() const; // True if the background sonar engine is running
+	void run(); // Progresses the sonar engine. Call this often (like DriveControl's run()).
+	SonarReading getSonarReading(int side); // Returns the latest timestamped reading of a SONAR_<SIDE>
+	void setAdaptiveRange(bool adapt); // Turns the adaptive listening range of the sonars on (default) or off
+	void setSonarFilter(byte window, float hampel_k = FILTER_HAMPEL_K, byte zero_limit = FILTER_ZERO_LIMIT); // Sets up all the sonar filters
+	static void handlePinChange(); // Called from the pin change interrupt (timestamps echo edges)
+
+	// Snapshots (every sensor in one go)
+	void fillSnapshot(SensorSnapshot & snap); // Fills in a timestamped reading of every sensor
+	void setSnapshotInterval(int interval); // Lets run() re-read the mag and floor every interval ms (0 turns it off)
+
+	// Wall fitting (from the side sonars while driving)
+	void setTravelled(float dist); // Tell the sensors how far (mm) we've driven (e.g. DriveControl's getDistanceTravelled())
+	void resetWallFit(); // Forget the fitted walls (call this after turning)
+	bool isWallFitValid(int side); // True if there's a trustworthy fit for SONAR_LEFT or SONAR_RIGHT
+	float getWallAngle(int side); // Angle (degrees) of the vehicle to that wall. Positive is turned right.
+	int getWallOffset(int side); // Distance (mm) from that sonar straight across to the wall
+
 	// Ultrasonic blipping
-	void SensorControl::getLeftBlipped(Array<int> out); // Returns the number of milliseconds since last blip on left sonar
-	void SensorControl::getRightBlipped(Array<int> out); // Same as above, but for the right sonar
+	void getLeftBlipped(Array<int> out); // Returns the number of milliseconds since last blip on left sonar
+	void getRightBlipped(Array<int> out); // Same as above, but for the right sonar
 
 	// TCRT5000
 	bool isFloorStart(); // Returns true if the floor is dark
@@ -73,15 +401,39 @@ public:
 	short getFloorType(); // Returns 1 if the floor is dark, 2 if the floor is light.
 	bool hasFloorChanged(int interval = 100); // Returns true if the floor has changed in the given interval
 	int getTimeFloorLastChanged(); // Returns how many milliseconds ago the floor changed
+	bool setFloorAnalog(int analog_pin, int emitter = -1); // Reads the line tracker's analog output from now on. False if it can't.
+	void setFloorClasses(const int bounds[], const short types[], byte count, int hysteresis = TCRT_HYSTERESIS); // Sets the floor classes for analog mode
+	int getFloorLevel(); // Averaged analog level of the floor (higher is lighter), or -1
+	float getFloorConfidence(); // How sure (0 to 1) we are of the floor type
 
 	 // Magnetic Sensor
 	void getMagComponents(Array<float> array); // Mods an x,y,z array of ints with field components
 	int getMagBearing(); // Returns xy plane angle of displacement
+	bool pollMagBearing(float & bearing); // Only if there's a new, valid reading: fills in its bearing and returns true
 	int getMagElevation(); // Returns angle of tile from horizon (negative if towards the ground)
-	float getMagStrength(); // Returns the strength of the magnetic field
-	float deltaMagScore(int interval = 100); // Returns a value between 0 and 1 based on how much the reading has changed in recent times
+	int getMagStrength(); // Returns the strength of the magnetic field (in milligauss)
+	float deltaMagScore(int interval = 100); // Returns a value between 0 and 1 based on how much the reading has changed in the last interval ms (up to MAG_STATS_SIZE readings)
+	bool isMagAnomaly(); // True if the field has moved away from the background (like it does near a target)
+	int getMagBaseline() const; // Strength (mG) of the background field, as tracked while driving around
+	void setMagWindow(unsigned int interval); // Sets the time window (ms) for the mag stats
+	void setMagBaselineTime(unsigned int time_constant); // Sets how quickly (ms) the background tracker follows changes
+	void resetMagBaseline(); // Starts tracking the background again from the next reading
 	bool isMagValid(); // True if none of the axial components are maxed out
 	bool isMagInRange(); // True if the magnitude of the signal is far enough from Earth's magnetic field
+
+	// Magnetic sensor calibration
+	void beginMagCalibration(MagCalibrator & calibrator); // Starts collecting readings into calibrator (start the vehicle spinning). Keep it around until endMagCalibration.
+	bool sampleMagCalibration(); // Call often while spinning. True if a new reading was collected.
+	bool endMagCalibration(bool save = true); // Fits, applies and (optionally) saves the calibration
+	bool loadMagCalibration(); // Loads the calibration from EEPROM (done in setSensorPins). False if there isn't one.
+	void saveMagCalibration(); // Saves the current calibration to EEPROM
+	void clearMagCalibration(); // Goes back to uncorrected readings
+	int getMagBackground() const; // Strength (mG) of the background field that targets are compared to
+
+	// Finding a target by turning on the spot
+	void beginMagSweep(MagSweep & sweep); // Starts collecting readings into sweep (start the vehicle turning). Keep it around until endMagSweep.
+	bool sampleMagSweep(float heading); // Call often while turning, with the heading (degrees). True if a new reading was collected.
+	bool endMagSweep(MagTarget & target); // Works out where the strongest target is. False if there wasn't one.
 private:
 	/*
 		Sensor Objects (constructed, then overwritten)
@@ -97,24 +449,90 @@ private:
 
 	// State variables
 	unsigned long _last_floor_time; // Time value in ms since last floor check (and it changed)
-	unsigned long _last_ping_time = 0;  // Time value in ms since last ping (to avoid cross talk)
+	NewPing * _sonars[SONAR_COUNT] = {&front_sonar, &right_sonar, &rear_sonar, &left_sonar}; // Clockwise from front
+	byte _sonar_pins[SONAR_COUNT]; // Trigger/echo pin of each sonar
+	SonarReading _sonar_cache[SONAR_COUNT]; // Latest reading from each sonar
+	SonarFilter _filters[SONAR_COUNT]; // Cleans up the pings of each sonar
+	bool _adapt_range = true; // Shrink each sonar's listening range to fit its last reading
+	unsigned int _sonar_range[SONAR_COUNT]; // How far (in cm) each sonar listens for on its next ping
+
+	// Sonar engine (and echo capture, shared with snapshots). The echo edges
+	// are timestamped by the pin change interrupt, everything else is handled
+	// by run().
+	SonarEngine _engine;
+	byte _sonar_bits[SONAR_COUNT]; // Port bit of each sonar
+	volatile uint8_t * _echo_port; // Input register of the sonars
+	static SensorControl * _isr_owner; // Instance serviced by the pin change interrupt
 	bool _last_floor_state;
-	float _mag_history[3]; // Keeps the magnitude score of the last three readings
 
-	struct PingCapture {
-		unsigned long s_time = 0;
-		unsigned short dist = 0;
-	};
+	// Floor capture. The interrupt adds a timestamped event to the ring every
+	// time the line tracker's pin changes, and drainFloor() takes them out.
+	volatile uint8_t * _floor_port; // Input register of the line tracker
+	byte _floor_pin; // Digital pin of the line tracker
+	byte _floor_bit = 0; // Port bit of the line tracker (0 if it isn't captured)
+	volatile bool _floor_isr_main = false; // Floor seen by the last interrupt
+	volatile unsigned long _floor_event_time[FLOOR_EVENTS]; // Time value in ms of each change
+	volatile bool _floor_event_main[FLOOR_EVENTS]; // Floor after each change
+	volatile byte _floor_head = 0; // Next slot the interrupt writes to (only the interrupt changes this)
+	byte _floor_tail = 0; // Next slot to take out (only drainFloor() changes this)
+	volatile bool _floor_overflow = false; // Set if the ring filled up and a change was lost
+	bool _floor_pending = false; // True if there's a change waiting out the debounce time
+	bool _floor_pending_main;
+	unsigned long _floor_pending_time;
+	short _floor_types[TCRT_MAX_CLASSES] = FLOOR_TYPES; // Floor type of each analog class
+	MagReading _mag_cache; // Latest magnetic reading (every mag getter reads from this)
+	unsigned long _mag_read_us = 0; // Time value in us when we last asked the sensor for a reading
+	unsigned long _mag_wait = 0; // How long (us) to wait after that before asking again (0 until the first read)
+	FloorReading _floor_cache; // Latest floor reading taken for a snapshot
+	int _snap_interval = 0; // Time (ms) between background mag/floor reads (0 is off)
+	unsigned long _snap_time = 0; // Time value in ms of the last background read
+	unsigned long _mag_sq = 0; // Squared strength of the cached reading
+	int _mag_q8 = 0; // Milligauss per sensor digit, times 256
+	int _mag_raw[3]; // Latest reading before calibration (mG)
+	MagCalibration _mag_cal; // Applied to every reading
+	unsigned long _mag_high_sq = MAG_HIGH_SQ; // Squared limits for isMagInRange (from the background field)
+	unsigned long _mag_low_sq = MAG_LOW_SQ;
+	MagCalibrator * _calibrator = NULL; // The caller's, while calibrating
+	MagSweep * _sweep = NULL; // The caller's, while sweeping
+	int _mag_strength = 0; // Strength (mG) of the cached reading
+	MagStats _mag_stats; // Streaming stats of the recent field strength
+	long _baseline_q8 = 0; // Background field strength (mG times 256), tracked slowly while there's no target
+	long _noise_q8 = (long) MAG_ANOMALY_MIN * 256 / MAG_ANOMALY_K; // Usual standard deviation of the field (mG times 256)
+	bool _baseline_set = false; // False until the tracker has had its first reading
+	unsigned long _baseline_time = 0; // Time value in ms of the last tracker update
+	bool _baseline_frozen = false; // True while the tracker is holding still for an anomaly
+	unsigned long _freeze_time = 0; // Time value in ms when it started holding still
+	unsigned int _baseline_tau = MAG_BASELINE_TIME;
+	bool magAnomaly() const; // isMagAnomaly without the read
+	void trackMagBaseline(); // Updates the stats and background tracker with a new reading
+
+	float _travelled = 0; // Distance (mm) driven, as last told by setTravelled
+	float _wall_last[2] = {-WALL_MIN_STEP, -WALL_MIN_STEP}; // Travelled distance of the last ping added to each wall fit
+	WallFit _walls[2]; // Right and left wall fits (see wallIndex)
+	int wallIndex(int side) const; // Index into _walls for a side sonar, or -1
 
-	PingCapture _l_blip_hist[BLIP_HIST]; // Keeps a record of left pings
-	PingCapture _r_blip_hist[BLIP_HIST]; // Keeps a record of right pings
-	int _last_right_blip;
-	int _last_left_blip;
-	void pushToBlipStore(int dist, PingCapture blip_store[]);
-	void SensorControl::getBlippedFromStore(PingCapture blip_store[], Array<int> out); // Fills an array with time and dist of blip
+	BlipStore _l_blips; // Keeps a record of left pings
+	BlipStore _r_blips; // Keeps a record of right pings
+	void getBlippedFromStore(const BlipStore & store, Array<int> out); // Fills an array with time and dist of blip
 
-	int getDistance(NewPing sonar); // Returns the distance ping in mm (rather than cm)
+	int getDistance(int side); // Returns the distance ping in mm (rather than cm)
 	int getPingDelay(); // Returns a delay (in ms) that should work to wait for next ping
+	void storeReading(int side, int dist); // Caches a reading (and feeds the blip stores)
+	void adaptRange(int side, int dist); // Picks the listening range of a sonar's next ping
+	unsigned int fullRange() const; // Furthest (in cm) any sonar ever needs to listen
+	bool setupCapture(); // Checks the sonar pins suit the pin change interrupt and turns it on
+	bool setupFloorCapture(int pin); // As above, for the line tracker
+	void drainFloor(); // Takes the floor changes out of the ring (and debounces them)
+	void floorEvent(unsigned long s_time, bool main); // Handles one floor change from the ring
+	void fireSonar(int side); // Sends a trigger pulse and arms the echo capture
+	int checkEcho(int side); // Distance in mm once the echo is over, otherwise ECHO_WAITING
+	void releaseSonar(int side); // Stops listening to a sonar's echo
+	void finishPing(int dist); // Stores the engine's reading and frees the engine
+	void pingGroup(const byte sides[], int count, int dists[]); // Pings several sonars at once (staggered)
+	bool pingAll(); // Refreshes every sonar reading (in pairs if possible). False if it had to go one at a time.
+	bool readMag(); // Reads the magnetic sensor into the cache. True if it had a new reading.
+	void applyMagCalibration(const MagCalibration & cal); // Starts correcting readings with cal
+	void readFloor(); // Reads the line tracker into the cache
 };
 
 
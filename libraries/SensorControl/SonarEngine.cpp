@@ -0,0 +1,105 @@
+#include "SonarEngine.h"
+
+#if defined(ARDUINO)
+static unsigned int echoToCm(unsigned int echo) {
+	return NewPing::convert_cm(echo);
+}
+#else
+// No interrupts on a PC, so there's nothing to hold off
+static void noInterrupts() {}
+static void interrupts() {}
+
+// Same as NewPing::convert_cm with its default settings (no rounding)
+static unsigned int echoToCm(unsigned int echo) {
+	return echo / US_ROUNDTRIP_CM;
+}
+#endif
+
+void SonarEngine::start() {
+	_pinging = false;
+	_on = true;
+}
+
+void SonarEngine::stop() {
+	_on = false;
+}
+
+// Moves on to the next sonar once PING_INTERVAL has passed since the last
+// ping. The caller fires it (and arms the capture).
+int SonarEngine::nextPing(unsigned long ms) {
+	if (!_on || _pinging || ms - _last_ping < PING_INTERVAL) {
+		return -1;
+	}
+	_side = (_side + 1) % SONAR_COUNT;
+	_pinging = true;
+	return _side;
+}
+
+void SonarEngine::donePing(unsigned long ms) {
+	_pinging = false;
+	_last_ping = ms;
+}
+
+// Clears a sonar's edge times and starts watching its bit of the port. Only
+// that bit of the last port state is brought up to date: other sonars may
+// still be listening, and an edge of theirs that hasn't reached edge() yet
+// (interrupts are off) would otherwise look like no change, and be lost.
+void SonarEngine::arm(int side, unsigned long us, byte port) {
+	_rise[side] = 0;
+	_fall[side] = 0;
+	_last = (_last & ~_bits[side]) | (port & _bits[side]);
+	_mask |= _bits[side];
+	_fire_time[side] = us;
+}
+
+void SonarEngine::release(int side) {
+	_mask &= ~_bits[side];
+}
+
+// Timestamps the rising and falling edges of the echo pulse on the sonars
+// we're listening to
+void SonarEngine::edge(unsigned long us, byte port) {
+	byte changed = (port ^ _last) & _mask;
+	_last = port;
+	if (!changed) {
+		return;
+	}
+
+	for (byte i = 0; i < SONAR_COUNT; ++i) {
+		byte bit = _bits[i];
+		if (changed & bit) {
+			if (port & bit) {
+				_rise[i] = us;
+			} else if (_rise[i] != 0) {
+				_fall[i] = us;
+			}
+		}
+	}
+}
+
+// Returns the distance (in mm) once the echo is over (NO_ECHO if nothing came
+// back), or ECHO_WAITING if we're still listening.
+int SonarEngine::check(int side, unsigned long us, unsigned int range_cm) const {
+	// Take a consistent copy of the edge times from the interrupt
+	noInterrupts();
+	unsigned long rise = _rise[side];
+	unsigned long fall = _fall[side];
+	interrupts();
+
+	if (fall != 0 && rise != 0) {
+		// Echo came back. Pulse length is the round trip time.
+		return echoToCm(fall - rise) * 10;
+	} else if (rise == 0 && us - _fire_time[side] > SONAR_START_DELAY) {
+		return NO_ECHO; // Sonar never started, so give up on it.
+	} else if (rise != 0 && us - rise > (unsigned long) (range_cm + 1) * US_ROUNDTRIP_CM) {
+		return NO_ECHO; // Nothing in range
+	}
+	return ECHO_WAITING;
+}
+
+unsigned long SonarEngine::getFall(int side) const {
+	noInterrupts();
+	unsigned long fall = _fall[side];
+	interrupts();
+	return fall;
+}
@@ -0,0 +1,94 @@
+/*
+
+The timing side of SensorControl's background sonar engine: which sonar to
+ping next and when, and turning the echo pin's edges into a distance. It
+never touches the hardware. Times and the state of the sonars' input port are
+passed in, so the same code runs on the UNO (from SensorControl and its pin
+change interrupt) and on a PC (see tests/sonar_engine_host).
+
+License: GPLv3
+
+*/
+
+#ifndef sonarengine_h
+#define sonarengine_h
+
+#if defined(ARDUINO)
+  // Pull in the Arduino standard libraries
+  #if ARDUINO >= 100
+    #include "Arduino.h"
+  #else
+    #include "WProgram.h"
+    #include "pins_arduino.h"
+    #include "WConstants.h"
+  #endif
+  #include <NewPing.h> // US_ROUNDTRIP_CM and NO_ECHO
+#else
+  // Host build, so no Arduino core (or NewPing). Use NewPing's defaults.
+  #include <stdint.h>
+  typedef uint8_t byte;
+  #define US_ROUNDTRIP_CM 57
+  #define NO_ECHO 0
+#endif
+
+// Sonar indices (clockwise from the front, same order as fillDistArray)
+#define SONAR_FRONT 0
+#define SONAR_RIGHT 1
+#define SONAR_REAR 2
+#define SONAR_LEFT 3
+#define SONAR_COUNT 4
+
+#define PING_INTERVAL 20    // Minimum amount of time to wait (ms) in-between pings.
+#define SONAR_START_DELAY 6000 // Maximum time (us) for a sonar to start its echo pulse after a trigger
+#define ECHO_WAITING -1 // Internal marker for an echo we're still listening for
+
+/*
+
+The engine pings one sonar at a time, going clockwise from the front, and
+leaves PING_INTERVAL between the end of one ping and the start of the next.
+nextPing() says when it's time to fire (and which sonar), check() says when
+the echo is over, and donePing() frees the engine again. Blocking pings call
+donePing() too, so they keep their distance from the engine's.
+
+The echo capture is shared with snapshots, which listen to more than one
+sonar at a time. arm() starts listening to a sonar, and edge() (from the pin
+change interrupt) timestamps the start and end of its echo pulse. The
+interrupt and the rest of the code share the capture state, so arm() and
+release() have to be called with interrupts off.
+
+*/
+class SonarEngine
+{
+public:
+	SonarEngine() {};
+	void setBit(int side, byte bit) { _bits[side] = bit; }; // Port bit of a sonar's echo pin
+	void start(); // Starts the round robin
+	void stop(); // Stops it (call donePing() first if a sonar is in flight)
+	bool isOn() const { return _on; };
+	bool isPinging() const { return _pinging; }; // True while a sonar is waiting for its echo
+	byte getSide() const { return _side; }; // Sonar currently (or most recently) in flight
+	int nextPing(unsigned long ms); // The sonar to fire now (time in ms), or -1 if it isn't time yet
+	void donePing(unsigned long ms); // A ping has finished (time in ms), so the next one can be timed from it
+	unsigned long getLastPing() const { return _last_ping; }; // Time value in ms when the last ping finished
+
+	void arm(int side, unsigned long us, byte port); // Starts listening to a sonar fired at us, with the port as it is now
+	void release(int side); // Stops listening to a sonar
+	bool isListening() const { return _mask != 0; };
+	void edge(unsigned long us, byte port); // The port changed (from the pin change interrupt)
+	int check(int side, unsigned long us, unsigned int range_cm) const; // Distance (mm) once the echo is over, otherwise ECHO_WAITING
+	unsigned long getFall(int side) const; // Time value in us when a sonar's echo ended (0 if it hasn't)
+private:
+	bool _on = false;
+	bool _pinging = false;
+	byte _side = SONAR_LEFT; // So the first ping is the front one
+	unsigned long _last_ping = 0;
+	byte _bits[SONAR_COUNT] = {};
+	unsigned long _fire_time[SONAR_COUNT]; // Time value in us when each trigger was sent
+	volatile byte _mask = 0; // Port bits of the sonars we're listening to
+	volatile byte _last = 0; // Port state seen by the last edge
+	volatile unsigned long _rise[SONAR_COUNT]; // Time value in us when each echo pulse started
+	volatile unsigned long _fall[SONAR_COUNT]; // Time value in us when each echo pulse ended
+};
+
+
+#endif
@@ -41,3 +41,172 @@ bool TCRT5000::isClose(){
         return status;
     }
 }
+
+/*
+Analog mode (AVR only - it drives the ADC registers directly)
+*/
+
+TCRT5000 * TCRT5000::_adc_owner = NULL;
+
+bool TCRT5000::beginAnalog(int AP, int LP){
+#if defined(__AVR__)
+    if (AP >= A0) {
+        AP -= A0;  // channel number
+    }
+    if (AP < 0 || AP > 7) {
+        return false;
+    }
+    if (LP >= 0) {
+        pinMode(LP, OUTPUT);
+        digitalWrite(LP, LOW);
+        _lp = LP;
+    }
+
+    noInterrupts();
+    _adc_owner = this;
+    _lp_bit = (_lp >= 0) ? digitalPinToBitMask(_lp) : 0;
+    _lp_port = (_lp >= 0) ? portOutputRegister(digitalPinToPort(_lp)) : NULL;
+    _lit = false;
+    _sum = 0;
+    _count = 0;
+    _level = -1;
+    _class_time = millis();
+    if (AP < 6) {
+        DIDR0 |= _BV(AP);  // analog only, saves power
+    }
+    ADMUX = _BV(REFS0) | AP;  // AVcc reference
+    ADCSRB = _BV(ADTS2);  // start on timer 0 overflow
+    ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    interrupts();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void TCRT5000::endAnalog(){
+#if defined(__AVR__)
+    noInterrupts();
+    if (_adc_owner == this) {
+        ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);  // back to how analogRead() likes it
+        ADCSRB = 0;
+        _adc_owner = NULL;
+    }
+    if (_lp_bit) {
+        *_lp_port &= ~_lp_bit;
+    }
+    interrupts();
+#endif
+}
+
+bool TCRT5000::isAnalog() const{
+    return _adc_owner == this;
+}
+
+int TCRT5000::getLevel() const{
+    noInterrupts();
+    int level = _level;
+    interrupts();
+    return level;
+}
+
+void TCRT5000::setClasses(const int * bounds, byte count, int hysteresis){
+    count = min(count, TCRT_MAX_CLASSES - 1);
+    noInterrupts();
+    for (byte i = 0; i < count; ++i) {
+        _bounds[i] = bounds[i];
+    }
+    _nbounds = count;
+    _hysteresis = max(hysteresis, 0);
+    _class = 0;
+    if (_level >= 0) {
+        classify(_level);
+    }
+    interrupts();
+}
+
+byte TCRT5000::getClass() const{
+    return _class;
+}
+
+unsigned long TCRT5000::getClassTime() const{
+    noInterrupts();
+    unsigned long class_time = _class_time;
+    interrupts();
+    return class_time;
+}
+
+float TCRT5000::getConfidence() const{
+    noInterrupts();
+    int level = _level;
+    byte c = _class;
+    interrupts();
+    if (level < 0) {
+        return 0;  // nothing yet
+    }
+    if (_nbounds == 0) {
+        return 1;
+    }
+
+    // Distance inside the class, from the nearest bound
+    int inside = 1023;
+    if (c > 0) {
+        inside = min(inside, level - _bounds[c - 1]);
+    }
+    if (c < _nbounds) {
+        inside = min(inside, _bounds[c] - level);
+    }
+    return constrain(inside / (2.0 * max(_hysteresis, 1)), 0, 1);
+}
+
+// Walks up (or down) one class at a time, as long as the level is past the
+// bound by the hysteresis
+void TCRT5000::classify(int level){
+    byte c = _class;
+    while (c < _nbounds && level >= _bounds[c] + _hysteresis) {
+        c++;
+    }
+    while (c > 0 && level < _bounds[c - 1] - _hysteresis) {
+        c--;
+    }
+    if (c != _class) {
+        _class = c;
+        _class_time = millis();
+    }
+}
+
+void TCRT5000::handleADC(){
+#if defined(__AVR__)
+    TCRT5000 * self = _adc_owner;
+    if (self == NULL) {
+        return;
+    }
+    int value = ADC;
+
+    if (self->_lp_bit) {
+        // Emitter on: more light means a lower reading. Off: just ambient.
+        self->_sum += self->_lit ? -value : value;
+        self->_lit = !self->_lit;
+        if (self->_lit) {
+            *self->_lp_port |= self->_lp_bit;  // next sample (1 ms away) is lit
+            return;
+        }
+        *self->_lp_port &= ~self->_lp_bit;
+    } else {
+        self->_sum += 1023 - value;
+    }
+
+    if (++self->_count >= TCRT_AVERAGE) {
+        self->_level = max(self->_sum / self->_count, 0);
+        self->_sum = 0;
+        self->_count = 0;
+        self->classify(self->_level);
+    }
+#endif
+}
+
+#if defined(__AVR__)
+ISR(ADC_vect){
+    TCRT5000::handleADC();
+}
+#endif
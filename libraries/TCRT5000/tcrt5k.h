@@ -23,13 +23,81 @@ Umut Karci ( http://www.umutkarci.com )
         #include "WProgram.h"
     #endif
 
+    #include <FastPin.h>
+
+    #define TCRT_MAX_CLASSES 6  // Most floor classes analog mode can tell apart
+    #define TCRT_AVERAGE 8      // Samples averaged into each level (one sample per ms)
+    #define TCRT_HYSTERESIS 20  // Default distance (ADC counts) past a bound before the class changes
+
+    /*
+    Analog mode reads the sensor's analog output in the background. The ADC is
+    started by the timer 0 overflow (about once a millisecond, without touching
+    millis()), and its interrupt averages TCRT_AVERAGE samples into a level:
+    higher means more reflective. If there's an emitter pin, it's switched on
+    and off every other sample, and the level is the difference, so ambient
+    light cancels out. Each new level is sorted into a class (by the bounds
+    from setClasses), with some hysteresis so it doesn't flicker on an edge.
+    analogRead() can't be used while analog mode is on.
+    */
     class TCRT5000{
         public:
             TCRT5000(int RP);
             TCRT5000(int RP, int LP);
             bool isClose();
+
+            bool beginAnalog(int AP, int LP = -1); // Starts analog mode on analog pin AP (with an emitter pin, optionally)
+            void endAnalog();
+            bool isAnalog() const;
+            int getLevel() const; // Latest averaged level (0 to 1023, higher is lighter), or -1 before the first
+            void setClasses(const int * bounds, byte count, int hysteresis = TCRT_HYSTERESIS); // count ascending bounds make count + 1 classes
+            byte getClass() const; // Class of the latest level (0 is the darkest)
+            unsigned long getClassTime() const; // Time value in ms when the class last changed
+            float getConfidence() const; // 0 on a bound, up to 1 once the level is twice the hysteresis inside its class
+            static void handleADC(); // Called from the ADC interrupt
         private:
             int _rp;
             int _lp = -1;
+
+            static TCRT5000 * _adc_owner; // Instance serviced by the ADC interrupt
+            volatile uint8_t * _lp_port; // Output register of the emitter
+            byte _lp_bit = 0; // Port bit of the emitter (0 if there isn't one)
+            int _bounds[TCRT_MAX_CLASSES - 1];
+            byte _nbounds = 0;
+            int _hysteresis = TCRT_HYSTERESIS;
+            volatile int _sum = 0; // Samples so far towards the next level
+            volatile byte _count = 0;
+            volatile bool _lit = false; // Emitter is on for the sample being taken
+            volatile int _level = -1;
+            volatile byte _class = 0;
+            volatile unsigned long _class_time = 0;
+            void classify(int level); // Moves _class to fit a new level
+    };
+
+    /*
+    Same as TCRT5000::isClose(), with the pins fixed when compiling, so the
+    read is a single register read (see FastPin). LP is the IR-diode pin, or
+    -1 if it isn't connected.
+    */
+    template <byte RP, int LP = -1>
+    class FastTCRT5000{
+        public:
+            void begin(){
+                FastPin<RP>::input();
+                if (LP >= 0) {
+                    FastPin<EMITTER>::output();
+                }
+            }
+            bool isClose(){
+                if (LP < 0) {
+                    return !FastPin<RP>::read();  // just check for it
+                }
+                FastPin<EMITTER>::high();  // lit the diode
+                delayMicroseconds(100);  // diode should power up in 100 us
+                bool status = !FastPin<RP>::read();
+                FastPin<EMITTER>::low();  // dim the diode
+                return status;
+            }
+        private:
+            static const byte EMITTER = (LP < 0) ? RP : LP;  // keeps FastPin happy when there's no diode
     };
 #endif
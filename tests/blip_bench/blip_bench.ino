@@ -0,0 +1,88 @@
+#include <SensorControl.h>
+#include <ARDVARC_UTIL.h>
+
+/*
+	Compares the cost of the blip store before and after the ring buffer.
+	The old shift-and-rescan store is copied here so both run on the same board.
+	Open the serial monitor to see per-push and per-query times (in us).
+*/
+
+#define RUNS 200
+
+// The old blip store (shift on every push, rescan on every query)
+PingCapture old_store[BLIP_HIST];
+
+void oldPush(int dist) {
+	for (int i = BLIP_HIST - 1; i > 0; --i) {
+		old_store[i] = old_store[i - 1];
+	}
+	old_store[0].dist = dist;
+	old_store[0].s_time = millis();
+}
+
+int oldQuery() {
+	int expected = 0;
+	int rising_edge = BLIP_HIST;
+	for (int i = 1; i < BLIP_HIST; ++i) {
+		if (old_store[i].dist - old_store[i - 1].dist < -1 * BLIP_THRESHOLD) {
+			rising_edge = i;
+			expected = old_store[i - 1].dist;
+			break;
+		}
+	}
+	for (int i = rising_edge; i < BLIP_HIST; ++i) {
+		if (abs(old_store[i].dist - expected) < BLIP_RETURN_THRESHOLD) {
+			return millis() - old_store[rising_edge].s_time;
+		}
+	}
+	return -1;
+}
+
+BlipStore new_store;
+
+// Something walks past the sonar every 10 pings
+int fakePing(int i) {
+	return (i % 10 == 5) ? 300 : 800;
+}
+
+void setup() {
+	Serial.begin(9600);
+
+	unsigned long start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		oldPush(fakePing(i));
+	}
+	unsigned long old_push = micros() - start;
+
+	volatile int sink = 0; // Stops the compiler throwing the queries away
+	start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		sink += oldQuery();
+	}
+	unsigned long old_query = micros() - start;
+
+	start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		new_store.push(fakePing(i), millis());
+	}
+	unsigned long new_push = micros() - start;
+
+	PingCapture blip;
+	start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		sink += new_store.getBlip(blip);
+	}
+	unsigned long new_query = micros() - start;
+
+	Serial.print("Push (old, new): ");
+	Serial.print(old_push / (float) RUNS);
+	Serial.print(", ");
+	Serial.println(new_push / (float) RUNS);
+	Serial.print("Query (old, new): ");
+	Serial.print(old_query / (float) RUNS);
+	Serial.print(", ");
+	Serial.println(new_query / (float) RUNS);
+}
+
+void loop() {
+}
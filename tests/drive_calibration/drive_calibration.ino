@@ -0,0 +1,55 @@
+#include <SensorControl.h>
+#include <DriveControl.h>
+#include <DriveCalibration.h>
+#include <ARDVARC_UTIL.h>
+
+/*
+	Calibrates the drive constants (RPDC, wheel scales, back scaling, spin
+	scales and nudge scale). Calibrate the magnetic sensor first
+	(mag_calibration). Then face the vehicle square on to a wall, 550 to
+	1500 mm away, with room to spin, and reset it. It turns on each wheel,
+	drives to the wall and back, and spins each way, then saves what it
+	measured to EEPROM. From then on, sketches that call
+	driver.loadCalibration() use them.
+	Open the serial monitor to see the results.
+*/
+
+SensorControl sensors;
+DriveControl driver;
+DriveCalibrator calibrator(driver, sensors);
+
+void setup() {
+	Serial.begin(9600);
+	sensors.setSensorPins(10, 11, 8, 9, 12);
+	driver.setMotorPins(3, 4, 2, 5, 6, 7);
+	driver.setWheelDiameter(55);
+	driver.setTrackWidth(105);
+	driver.setRevsPerDC(14);
+	driver.loadCalibration(); // Start from the last run, if there was one
+
+	delay(2000); // Time to step away
+
+	if (calibrator.calibrate()) {
+		Serial.println("Saved.");
+	} else {
+		Serial.println("Calibration failed. Check the wall distance and the compass, then reset to try again.");
+		return;
+	}
+
+	// Check it: there and back should end up where it started, facing the same way
+	driver.forward(300);
+	driver.turnAngle(180);
+	driver.forward(300);
+	driver.turnAngle(180);
+	driver.run();
+	while (driver.isDriving()) {
+		driver.run();
+	}
+	driver.stopAll();
+}
+
+void loop() {
+	// Show the front distance, to compare with where it started
+	Serial.println(sensors.getFrontDistance());
+	delay(500);
+}
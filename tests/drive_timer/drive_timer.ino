@@ -0,0 +1,43 @@
+#include <DriveControl.h>
+#include <ARDVARC_UTIL.h>
+
+/*
+	Checks that the timer keeps instructions on time while the sketch is busy.
+	The same 200 mm drive is run twice, with a 150 ms delay() standing in
+	for slow sensor reads: first with run() called by hand, then on the
+	timer. Lift the wheels off the ground, and open the serial monitor to see
+	how far (in mm) the wheels were driven each time. The timer one should be
+	close to 200, the other one over by up to 150 ms worth of driving.
+*/
+
+DriveControl driver;
+
+float testDrive(bool timer) {
+	if (timer) {
+		driver.beginTimer();
+	}
+	driver.resetDistanceTravelled();
+	driver.forward(200);
+	driver.run();
+	while (driver.isDriving()) {
+		driver.run();
+		delay(150);
+	}
+	driver.endTimer();
+	return driver.getDistanceTravelled();
+}
+
+void setup() {
+	Serial.begin(9600);
+	driver.setMotorPins(3, 4, 2, 5, 6, 7);
+	driver.setWheelDiameter(55);
+	driver.setTrackWidth(105);
+	driver.setRevsPerDC(14);
+	Serial.print("By hand: ");
+	Serial.println(testDrive(false));
+	Serial.print("Timer: ");
+	Serial.println(testDrive(true));
+}
+
+void loop() {
+}
@@ -0,0 +1,30 @@
+#include <SensorControl.h>
+#include <ARDVARC_UTIL.h>
+
+/*
+	Shows what the line tracker's analog output reads on each part of the
+	arena, so the bounds between the floor classes (FLOOR_BOUNDS) can be
+	set. Wire the tracker's analog output to A0 (the test switch pin), then
+	move the vehicle over the start zone, main floor, ramp and upper level.
+	Pick each bound about halfway between the levels either side of it.
+	Open the serial monitor to see the level, type and confidence.
+*/
+
+SensorControl sensors;
+
+void setup() {
+	Serial.begin(9600);
+	sensors.setSensorPins(10, 11, 8, 9, 12);
+	if (!sensors.setFloorAnalog(A0)) {
+		Serial.println("Couldn't start analog mode");
+	}
+}
+
+void loop() {
+	Serial.print(sensors.getFloorLevel());
+	Serial.print(",");
+	Serial.print(sensors.getFloorType());
+	Serial.print(",");
+	Serial.println(sensors.getFloorConfidence());
+	delay(100);
+}
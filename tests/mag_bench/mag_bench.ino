@@ -0,0 +1,65 @@
+#include <SensorControl.h>
+#include <HMC5883L.h>
+#include <Wire.h>
+#include <ARDVARC_UTIL.h>
+
+/*
+	Compares the I2C bus time of one magnetic "decision" before and after the
+	burst read and reading cache. A decision is what Final_Sketch does when it
+	looks at the mag: check the range, the validity and the bearing (and
+	elevation). Before, every one of those getters did its own readNormalize()
+	(three I2C transactions each). Now they all share one cached burst read.
+	Open the serial monitor to see per-decision times (in us).
+*/
+
+#define RUNS 200
+
+SensorControl sensors;
+HMC5883L bench_mag; // Talks to the same chip, for timing the raw reads
+
+void setup() {
+	Serial.begin(9600);
+	sensors.setSensorPins(10, 11, 8, 9, 12);
+	bench_mag.begin();
+	bench_mag.setRange(HMC5883L_RANGE_8_1GA);
+	bench_mag.setDataRate(HMC5883L_DATARATE_75HZ);
+
+	volatile float sink = 0; // Stops the compiler throwing the reads away
+
+	// Old decision: four getters, each with a three-transaction read
+	unsigned long start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		for (int g = 0; g < 4; ++g) {
+			sink += bench_mag.readNormalize().XAxis;
+		}
+	}
+	unsigned long old_decision = micros() - start;
+
+	// One burst read (what a decision costs now, when the sensor has a new reading)
+	start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		sink += bench_mag.readNormalizeBurst().XAxis;
+	}
+	unsigned long burst_read = micros() - start;
+
+	// New decision through SensorControl. Most of these hit the cache, and
+	// one in every 13.3 ms does a burst read.
+	start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		sink += sensors.isMagInRange();
+		sink += sensors.isMagValid();
+		sink += sensors.getMagBearing();
+		sink += sensors.getMagElevation();
+	}
+	unsigned long new_decision = micros() - start;
+
+	Serial.print("Old decision (4 x readNormalize): ");
+	Serial.println(old_decision / (float) RUNS);
+	Serial.print("Burst read (1 transaction): ");
+	Serial.println(burst_read / (float) RUNS);
+	Serial.print("New decision (cached getters): ");
+	Serial.println(new_decision / (float) RUNS);
+}
+
+void loop() {
+}
@@ -0,0 +1,52 @@
+#include <SensorControl.h>
+#include <DriveControl.h>
+#include <ARDVARC_UTIL.h>
+
+/*
+	Calibrates the magnetic sensor. Put the vehicle somewhere clear of
+	magnets and steel, then reset it. It spins on the spot twice while
+	collecting readings, works out the calibration and saves it to EEPROM.
+	From then on, SensorControl loads it at startup (in setSensorPins).
+	Open the serial monitor to see the results.
+*/
+
+SensorControl sensors;
+DriveControl driver;
+
+void setup() {
+	Serial.begin(9600);
+	sensors.setSensorPins(10, 11, 8, 9, 12);
+	driver.setMotorPins(3, 4, 2, 5, 6, 7);
+	driver.setWheelDiameter(55);
+	driver.setTrackWidth(105);
+	driver.setRevsPerDC(11);
+
+	Serial.print("Background before: ");
+	Serial.println(sensors.getMagBackground());
+
+	// Spin slowly, so there are plenty of readings all the way around
+	MagCalibrator calibrator;
+	sensors.beginMagCalibration(calibrator);
+	driver.turnAngle(720, 0.4);
+	driver.run();
+	while (driver.isDriving()) {
+		driver.run();
+		sensors.sampleMagCalibration();
+	}
+	driver.stopAll();
+
+	if (sensors.endMagCalibration()) {
+		Serial.print("Saved. Background after: ");
+		Serial.println(sensors.getMagBackground());
+	} else {
+		Serial.println("Calibration failed (not enough readings). Try a slower spin.");
+	}
+}
+
+void loop() {
+	// Show the corrected field, to check it stays steady while turning by hand
+	Serial.print(sensors.getMagStrength());
+	Serial.print(",");
+	Serial.println(sensors.getMagBearing());
+	delay(100);
+}
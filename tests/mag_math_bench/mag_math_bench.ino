@@ -0,0 +1,113 @@
+#include <ARDVARC_UTIL.h>
+#include <SensorControl.h>
+
+/*
+	Compares the cost of the magnetic maths before and after going to
+	integers. The old float versions are copied here so both run on the same
+	board. No sensor is needed, it works on a set of made-up readings.
+	Open the serial monitor to see the cycles per call of each path.
+*/
+
+#define RUNS 200
+#define SAMPLES 8
+
+// Made-up readings (milligauss), roughly what the sensor gives near a magnet
+const int samples[SAMPLES][3] = {
+	{400, -300, 200}, {1200, 800, -450}, {-900, 150, 1700}, {30, -1900, 60},
+	{-1500, -1500, 500}, {700, 20, -2200}, {-50, 600, -80}, {2100, -900, 1300}
+};
+
+// The old float paths
+float magtd3(float a, float b, float c) {
+	return sqrt(square(abs(a)) + square(abs(b)) + square(abs(c)));
+}
+
+bool oldInRange(float x, float y, float z) {
+	return abs(magtd3(x, y, z) - BACKGROUND_FIELD) > MAG_THRESHOLD;
+}
+
+int oldBearing(float x, float z) {
+	return atan2(z, x) * 180.0/PI + R_CORRECTION;
+}
+
+// The new integer paths (same as SensorControl)
+bool newInRange(int x, int y, int z) {
+	unsigned long sq = (long) x * x + (long) y * y + (long) z * z;
+	return sq > MAG_HIGH_SQ || sq < MAG_LOW_SQ;
+}
+
+int newBearing(int x, int z) {
+	return iatan2(z, x) + R_CORRECTION;
+}
+
+// Converts a total time (us) over RUNS * SAMPLES calls into cycles per call
+float cycles(unsigned long us) {
+	return us * (F_CPU / 1000000.0) / (RUNS * SAMPLES);
+}
+
+void setup() {
+	Serial.begin(9600);
+
+	volatile long sink = 0; // Stops the compiler throwing the results away
+	volatile float fx, fy, fz; // Stops the compiler doing the float maths ahead of time
+	volatile int ix, iy, iz;
+
+	unsigned long start = micros();
+	for (int r = 0; r < RUNS; ++r) {
+		for (int i = 0; i < SAMPLES; ++i) {
+			fx = samples[i][0]; fy = samples[i][1]; fz = samples[i][2];
+			sink += oldInRange(fx, fy, fz);
+		}
+	}
+	unsigned long old_range = micros() - start;
+
+	start = micros();
+	for (int r = 0; r < RUNS; ++r) {
+		for (int i = 0; i < SAMPLES; ++i) {
+			ix = samples[i][0]; iy = samples[i][1]; iz = samples[i][2];
+			sink += newInRange(ix, iy, iz);
+		}
+	}
+	unsigned long new_range = micros() - start;
+
+	start = micros();
+	for (int r = 0; r < RUNS; ++r) {
+		for (int i = 0; i < SAMPLES; ++i) {
+			fx = samples[i][0]; fz = samples[i][2];
+			sink += oldBearing(fx, fz);
+		}
+	}
+	unsigned long old_bearing = micros() - start;
+
+	start = micros();
+	for (int r = 0; r < RUNS; ++r) {
+		for (int i = 0; i < SAMPLES; ++i) {
+			ix = samples[i][0]; iz = samples[i][2];
+			sink += newBearing(ix, iz);
+		}
+	}
+	unsigned long new_bearing = micros() - start;
+
+	// Make sure the two paths agree
+	for (int i = 0; i < SAMPLES; ++i) {
+		if (oldInRange(samples[i][0], samples[i][1], samples[i][2]) !=
+			newInRange(samples[i][0], samples[i][1], samples[i][2]) ||
+			abs(oldBearing(samples[i][0], samples[i][2]) -
+			newBearing(samples[i][0], samples[i][2])) > 1) {
+			Serial.print("Mismatch on sample ");
+			Serial.println(i);
+		}
+	}
+
+	Serial.print("Range check cycles (old, new): ");
+	Serial.print(cycles(old_range));
+	Serial.print(", ");
+	Serial.println(cycles(new_range));
+	Serial.print("Bearing cycles (old, new): ");
+	Serial.print(cycles(old_bearing));
+	Serial.print(", ");
+	Serial.println(cycles(new_bearing));
+}
+
+void loop() {
+}
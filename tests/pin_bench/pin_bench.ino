@@ -0,0 +1,73 @@
+#include <L293dDriver.h>
+#include <tcrt5k.h>
+#include <FastPin.h>
+
+/*
+	Compares the cost of driving the motors and reading the line tracker
+	through the runtime pin classes (digitalWrite, analogWrite, digitalRead)
+	and the compile-time ones (FastL293D, FastTCRT5000). Uses the pins from
+	Final_Sketch. Lift the wheels off the ground first - the motors do run.
+	Open the serial monitor to see the cycles per call of each path.
+*/
+
+#define RUNS 1000
+
+L293D motors;
+FastL293D<3, 4, 2, 5, 6, 7> fast_motors;
+TCRT5000 floor_sensor(12);
+FastTCRT5000<12> fast_floor;
+
+// Converts a total time (us) over RUNS calls into cycles per call
+float cycles(unsigned long us) {
+	return us * (F_CPU / 1000000.0) / RUNS;
+}
+
+void setup() {
+	Serial.begin(9600);
+	motors.setLeft(3, 4, 2);
+	motors.setRight(5, 6, 7);
+	fast_motors.begin();
+	fast_floor.begin();
+
+	volatile byte sink = 0; // Stops the compiler throwing the reads away
+	const int speeds[4] = {120, -120, 200, 0};
+
+	// Both motors, the way DriveControl does it (two calls)
+	unsigned long start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		motors.left(speeds[i & 3]);
+		motors.right(-speeds[i & 3]);
+	}
+	unsigned long old_drive = micros() - start;
+
+	start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		fast_motors.drive(speeds[i & 3], -speeds[i & 3]);
+	}
+	unsigned long new_drive = micros() - start;
+	fast_motors.drive(0, 0);
+
+	start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		sink += floor_sensor.isClose();
+	}
+	unsigned long old_read = micros() - start;
+
+	start = micros();
+	for (int i = 0; i < RUNS; ++i) {
+		sink += fast_floor.isClose();
+	}
+	unsigned long new_read = micros() - start;
+
+	Serial.print("Drive both motors cycles (old, new): ");
+	Serial.print(cycles(old_drive));
+	Serial.print(", ");
+	Serial.println(cycles(new_drive));
+	Serial.print("Floor read cycles (old, new): ");
+	Serial.print(cycles(old_read));
+	Serial.print(", ");
+	Serial.println(cycles(new_read));
+}
+
+void loop() {
+}
@@ -0,0 +1,77 @@
+#include <SensorControl.h>
+#include <ARDVARC_UTIL.h>
+
+/*
+	Checks the background sonar engine against blocking pings. For each
+	sonar, it counts the engine's new readings over a few seconds, how many
+	of them timed out (no echo, so 0), and compares the last one with a
+	blocking ping taken straight after. Unplug one sonar to see its pings
+	time out while the others carry on. Keep still (and point the sonars at
+	something) while it runs. Open the serial monitor to see the results.
+*/
+
+#define RUN_TIME 5000 // ms to run the engine for each round
+
+SensorControl sensors;
+
+const char * names[SONAR_COUNT] = {"Front", "Right", "Rear", "Left"};
+
+void setup() {
+	Serial.begin(9600);
+	sensors.setSensorPins(10, 11, 8, 9, 12);
+	sensors.setSonarFilter(1); // Compare raw readings
+}
+
+void loop() {
+	unsigned long readings[SONAR_COUNT] = {0, 0, 0, 0};
+	unsigned long timeouts[SONAR_COUNT] = {0, 0, 0, 0};
+	unsigned long last_time[SONAR_COUNT] = {0, 0, 0, 0};
+	int engine_dist[SONAR_COUNT];
+
+	if (!sensors.startSonars()) {
+		Serial.println("Couldn't start the engine (are the sonars on pins 8-13?)");
+		while (true) {}
+	}
+	unsigned long start = millis();
+	unsigned long calls = 0;
+	while (millis() - start < RUN_TIME) {
+		sensors.run();
+		calls++;
+		for (int side = 0; side < SONAR_COUNT; ++side) {
+			SonarReading reading = sensors.getSonarReading(side);
+			if (reading.valid && reading.s_time != last_time[side]) {
+				last_time[side] = reading.s_time;
+				readings[side]++;
+				if (reading.dist == 0) {
+					timeouts[side]++;
+				}
+			}
+			engine_dist[side] = reading.dist;
+		}
+	}
+	sensors.stopSonars();
+
+	Serial.print("run() calls per ms: ");
+	Serial.println((float) calls / RUN_TIME);
+	for (int side = 0; side < SONAR_COUNT; ++side) {
+		int blocking;
+		switch (side) {
+		case SONAR_FRONT: blocking = sensors.getFrontDistance(); break;
+		case SONAR_RIGHT: blocking = sensors.getRightDistance(); break;
+		case SONAR_REAR: blocking = sensors.getRearDistance(); break;
+		default: blocking = sensors.getLeftDistance(); break;
+		}
+		Serial.print(names[side]);
+		Serial.print(": ");
+		Serial.print(readings[side] * 1000.0 / RUN_TIME);
+		Serial.print(" readings/s, ");
+		Serial.print(timeouts[side]);
+		Serial.print(" timed out, engine ");
+		Serial.print(engine_dist[side]);
+		Serial.print(" mm, blocking ");
+		Serial.print(blocking);
+		Serial.println(" mm");
+	}
+	Serial.println();
+	delay(1000);
+}
@@ -0,0 +1,141 @@
+/*
+	Runs SensorControl's sonar engine (SonarEngine) on a PC, with made up
+	times and port states standing in for micros(), millis() and the echo
+	pins. It checks the round robin timing, the edge capture and the echo
+	timeouts. No Arduino needed, just g++. From the repo's root:
+
+	g++ -Ilibraries/SensorControl -o sonar_engine_host tests/sonar_engine_host/sonar_engine_host.cpp libraries/SensorControl/SonarEngine.cpp
+	./sonar_engine_host
+
+	It prints each check that fails, and exits with 1 if any did.
+*/
+
+#include <SonarEngine.h>
+#include <stdio.h>
+
+// Port bit of each sonar (pins 10, 11, 8 and 9 are bits 2, 3, 0 and 1)
+const byte bits[SONAR_COUNT] = {0x04, 0x08, 0x01, 0x02};
+
+int failures = 0;
+
+void check(bool ok, const char * what) {
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+SonarEngine engineWithBits() {
+	SonarEngine engine;
+	for (int i = 0; i < SONAR_COUNT; ++i) {
+		engine.setBit(i, bits[i]);
+	}
+	return engine;
+}
+
+// The engine goes clockwise from the front, one sonar at a time, with
+// PING_INTERVAL between the end of one ping and the start of the next
+void testRoundRobin() {
+	SonarEngine engine = engineWithBits();
+	check(engine.nextPing(1000) == -1, "nothing is pinged before start()");
+
+	engine.start();
+	check(engine.nextPing(1000) == SONAR_FRONT, "the first ping is the front one");
+	check(engine.isPinging(), "pinging after nextPing()");
+	check(engine.nextPing(2000) == -1, "no second ping while one is in flight");
+
+	engine.donePing(2000);
+	check(engine.nextPing(2000 + PING_INTERVAL - 1) == -1, "waits out PING_INTERVAL");
+	check(engine.nextPing(2000 + PING_INTERVAL) == SONAR_RIGHT, "then the right one");
+	engine.donePing(3000);
+	check(engine.nextPing(3100) == SONAR_REAR, "then the rear one");
+	engine.donePing(3200);
+	check(engine.nextPing(3300) == SONAR_LEFT, "then the left one");
+	engine.donePing(3400);
+	check(engine.nextPing(3500) == SONAR_FRONT, "and back to the front");
+
+	engine.donePing(3600);
+	engine.stop();
+	check(engine.nextPing(4000) == -1, "nothing is pinged after stop()");
+}
+
+// A whole echo pulse comes back as a distance
+void testEcho() {
+	SonarEngine engine = engineWithBits();
+	byte port = 0;
+	engine.arm(SONAR_FRONT, 10000, port);
+	check(engine.check(SONAR_FRONT, 10100, 300) == ECHO_WAITING, "waiting before the echo starts");
+
+	port |= bits[SONAR_FRONT];
+	engine.edge(10400, port);
+	check(engine.check(SONAR_FRONT, 10500, 300) == ECHO_WAITING, "waiting during the echo");
+
+	port &= ~bits[SONAR_FRONT];
+	engine.edge(10400 + 100 * US_ROUNDTRIP_CM, port);
+	check(engine.check(SONAR_FRONT, 20000, 300) == 1000, "100 cm round trip reads as 1000 mm");
+	check(engine.getFall(SONAR_FRONT) == 10400 + 100 * US_ROUNDTRIP_CM, "the end of the echo is kept");
+}
+
+// Edges on sonars that aren't armed are ignored
+void testMask() {
+	SonarEngine engine = engineWithBits();
+	engine.arm(SONAR_FRONT, 10000, 0);
+	check(engine.isListening(), "listening once armed");
+
+	engine.edge(10200, bits[SONAR_RIGHT]);
+	engine.edge(10300, 0);
+	check(engine.getFall(SONAR_RIGHT) == 0, "an unarmed sonar's echo isn't captured");
+	check(engine.check(SONAR_FRONT, 10400, 300) == ECHO_WAITING, "nor mistaken for the armed one's");
+
+	engine.release(SONAR_FRONT);
+	check(!engine.isListening(), "not listening once released");
+	engine.edge(10500, bits[SONAR_FRONT]);
+	check(engine.check(SONAR_FRONT, 10600, 300) == ECHO_WAITING, "edges after release() are ignored");
+}
+
+// Arming a second sonar (as snapshots do) mustn't swallow an edge of the
+// first one that hasn't been seen yet
+void testPendingEdge() {
+	SonarEngine engine = engineWithBits();
+	byte port = 0;
+	engine.arm(SONAR_FRONT, 10000, port);
+	port |= bits[SONAR_FRONT];
+	engine.edge(10400, port);
+
+	// The front echo ends while interrupts are off for the rear's arm()
+	port &= ~bits[SONAR_FRONT];
+	engine.arm(SONAR_REAR, 10600, port);
+	engine.edge(10610, port); // The interrupt that was held off
+	check(engine.getFall(SONAR_FRONT) == 10610, "an edge pending during arm() isn't lost");
+	check(engine.check(SONAR_FRONT, 10700, 300) != ECHO_WAITING, "so the front ping finishes");
+}
+
+// Pings that never come back give up, rather than waiting forever
+void testTimeouts() {
+	SonarEngine engine = engineWithBits();
+
+	// Sonar never starts its pulse (unplugged)
+	engine.arm(SONAR_REAR, 10000, 0);
+	check(engine.check(SONAR_REAR, 10000 + SONAR_START_DELAY, 300) == ECHO_WAITING, "gives a sonar SONAR_START_DELAY to start");
+	check(engine.check(SONAR_REAR, 10001 + SONAR_START_DELAY, 300) == NO_ECHO, "then gives up on it");
+
+	// Pulse starts, but nothing comes back within the listening range
+	engine.arm(SONAR_LEFT, 20000, 0);
+	engine.edge(20400, bits[SONAR_LEFT]);
+	unsigned long limit = 20400 + (unsigned long) (50 + 1) * US_ROUNDTRIP_CM;
+	check(engine.check(SONAR_LEFT, limit, 50) == ECHO_WAITING, "listens out to the range");
+	check(engine.check(SONAR_LEFT, limit + 1, 50) == NO_ECHO, "then gives up");
+}
+
+int main() {
+	testRoundRobin();
+	testEcho();
+	testMask();
+	testPendingEdge();
+	testTimeouts();
+
+	if (failures == 0) {
+		printf("All sonar engine checks passed\n");
+	}
+	return failures == 0 ? 0 : 1;
+}